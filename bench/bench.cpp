@@ -0,0 +1,656 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Benchmarks of the lexer, preprocesser and parser over a corpus
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <src/arena.hpp>
+#include <src/base.hpp>
+#include <src/incremental.hpp>
+#include <src/lexer.hpp>
+#include <src/parser.hpp>
+#include <src/preprocesser.hpp>
+#include <src/thread_pool.hpp>
+
+using std::string, std::string_view, std::vector;
+
+// Each benchmark is repeated until it has run for at least this long (and at
+// least BENCH_MIN_RUNS times), reporting the fastest run.  Every %use adds a
+// file to the lexer's table, so runs are bounded to not overflow it.
+#define BENCH_MIN_TIME 0.5
+#define BENCH_MIN_RUNS 3
+#define BENCH_MAX_RUNS 200
+// Edits made to a document in each run of the edit benchmark
+#define BENCH_EDITS 1000
+// Units preprocessed in each batch when streaming a batch at a time, as asm -s
+// does, and how much peak RSS may grow over the latter half of the source, as
+// a fraction of its bytes
+#define BENCH_BATCH_SIZE    4096
+#define BENCH_STREAM_GROWTH 8
+
+static const char *corpora[] = {"flat.asm",     "nested.asm",
+                                "use-main.asm", "comments.asm",
+                                "literals.asm", "macros.asm"};
+
+struct Options
+{
+  const char *directory = nullptr, *revision = "unknown";
+  size_t threads        = std::thread::hardware_concurrency();
+};
+
+struct Result
+{
+  double seconds;
+  // Benchmarks of operations (e.g. edits) rather than of a pass over the
+  // source count those, leaving bytes and tokens at 0
+  size_t bytes, tokens, operations;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double since(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Add the bytes and tokens of every file included during a run to `result`,
+// so throughput covers all the source preprocessed.  Included files are only
+// lexed here once per process.
+void add_includes(const Preprocesser::Map &file_map, Result &result)
+{
+  static std::map<string, std::pair<size_t, size_t>> sizes;
+  for (const auto &[name, _] : file_map)
+  {
+    auto it = sizes.find(name);
+    if (it == sizes.end())
+    {
+      std::pair<size_t, size_t> size{0, 0};
+      auto source = read_file(name.c_str());
+      if (source.has_value())
+      {
+        size.first    = source.value().view().size();
+        uint16_t file = Lexer::add_file(name, std::move(source.value()));
+        Arena arena;
+        vector<Lexer::Token *> tokens;
+        tokenise_buffer(file, tokens, arena);
+        size.second = tokens.size();
+        arena.free();
+      }
+      it = sizes.insert({name, size}).first;
+    }
+    result.bytes += it->second.first;
+    result.tokens += it->second.second;
+  }
+}
+
+// A single run of a benchmark over `file`, returning false on an error in the
+// source.
+typedef bool (*Benchmark)(uint16_t file, Thread_Pool *pool, Result &);
+
+bool lex(uint16_t file, Thread_Pool *pool, Result &result)
+{
+  Arena arena;
+  vector<Lexer::Token *> tokens;
+  auto start     = Clock::now();
+  Lexer::Err err = pool ? tokenise_buffer(file, tokens, arena, *pool)
+                        : tokenise_buffer(file, tokens, arena);
+  result.seconds = since(start);
+  result.bytes   = Lexer::get_file(file).source.size();
+  result.tokens  = tokens.size();
+  arena.free();
+  if (err.type != Lexer::Err::Type::OK)
+  {
+    std::cerr << err << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Lexing and preprocessing together, as the assembler does it
+bool stream(uint16_t file, Thread_Pool *pool, Result &result)
+{
+  Arena arena;
+  Preprocesser::Const_Map const_map;
+  Preprocesser::Map file_map;
+  vector<Preprocesser::Unit> units;
+  Preprocesser::Tree tree;
+  auto start = Clock::now();
+  std::optional<Preprocesser::Includes> includes;
+  if (pool)
+  {
+    includes.emplace(*pool);
+    includes->load(file);
+  }
+  Lexer::Stream tokens{file, arena, pool};
+  Preprocesser::Err *err =
+      Preprocesser::preprocess(tokens, units, tree, arena, const_map, file_map,
+                               0, includes ? &*includes : nullptr);
+  includes.reset();
+  result.seconds = since(start);
+  result.bytes   = Lexer::get_file(file).source.size();
+  result.tokens  = tokens.count();
+  add_includes(file_map, result);
+  bool ok = true;
+  if (tokens.error().type != Lexer::Err::Type::OK)
+  {
+    std::cerr << tokens.error() << std::endl;
+    ok = false;
+  }
+  else if (err)
+  {
+    std::cerr << *err << std::endl;
+    ok = false;
+  }
+  arena.free();
+  return ok;
+}
+
+// Peak RSS of this process in KiB
+long peak_rss()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Lexing and preprocessing a batch of units at a time, as the assembler does
+// when streaming, releasing the tokens and transient expansions of each batch
+// before the next.  Memory held should then not grow with the source: the
+// first run fails if peak RSS grows by more than 1/BENCH_STREAM_GROWTH of the
+// bytes streamed after half way.  Included files are preprocessed whole, so
+// sources with a %use aren't checked.
+bool batches(uint16_t file, Thread_Pool *, Result &result)
+{
+  static bool checked = false;
+  Arena arena, window;
+  Preprocesser::Const_Map const_map;
+  Preprocesser::Map file_map;
+  vector<Preprocesser::Unit> units;
+  Preprocesser::Tree tree;
+  const size_t size = Lexer::get_file(file).source.size();
+  long half_rss     = 0;
+  auto start        = Clock::now();
+  Lexer::Stream tokens{file, window, nullptr, true};
+  Preprocesser::Err *err = nullptr;
+  do
+  {
+    units.clear();
+    tree.release();
+    tokens.release();
+    err = Preprocesser::preprocess(tokens, units, tree, arena, const_map,
+                                   file_map, 0, nullptr, nullptr,
+                                   BENCH_BATCH_SIZE);
+    if (!half_rss && !units.empty() &&
+        units.back().root->offset >= size / 2)
+      half_rss = peak_rss();
+  } while (!err && units.size() == BENCH_BATCH_SIZE);
+  result.seconds = since(start);
+  result.bytes   = size;
+  result.tokens  = tokens.count();
+  add_includes(file_map, result);
+  bool ok = true;
+  if (tokens.error().type != Lexer::Err::Type::OK)
+  {
+    std::cerr << tokens.error() << std::endl;
+    ok = false;
+  }
+  else if (err)
+  {
+    std::cerr << *err << std::endl;
+    ok = false;
+  }
+  else if (!checked && half_rss && file_map.empty() &&
+           (peak_rss() - half_rss) * 1024 >
+               static_cast<long>((size - size / 2) / BENCH_STREAM_GROWTH))
+  {
+    std::cerr << "ERROR: streaming grew peak RSS from " << half_rss
+              << " KiB at half way to " << peak_rss() << " KiB" << std::endl;
+    ok = false;
+  }
+  checked = true;
+  arena.free();
+  return ok;
+}
+
+// Preprocessing alone, over tokens lexed beforehand
+bool preprocess(uint16_t file, Thread_Pool *, Result &result)
+{
+  Arena arena;
+  vector<Lexer::Token *> tokens;
+  Lexer::Err lerr = tokenise_buffer(file, tokens, arena);
+  if (lerr.type != Lexer::Err::Type::OK)
+  {
+    std::cerr << lerr << std::endl;
+    return false;
+  }
+  Preprocesser::Const_Map const_map;
+  Preprocesser::Map file_map;
+  vector<Preprocesser::Unit> units;
+  Preprocesser::Tree tree;
+  auto start             = Clock::now();
+  Preprocesser::Err *err = Preprocesser::preprocess(
+      Slice<Lexer::Token *>{tokens.data(), tokens.size()}, units, tree, arena,
+      const_map, file_map);
+  result.seconds = since(start);
+  result.bytes   = Lexer::get_file(file).source.size();
+  result.tokens  = tokens.size();
+  add_includes(file_map, result);
+  if (err)
+    std::cerr << *err << std::endl;
+  arena.free();
+  return err == nullptr;
+}
+
+// Assembling alone, over units preprocessed beforehand.  With a pool, chunks
+// are encoded in parallel into a temporary file mapped in memory.
+bool assemble(uint16_t file, Thread_Pool *pool, Result &result)
+{
+  Arena arena;
+  vector<Lexer::Token *> tokens;
+  Lexer::Err lerr = tokenise_buffer(file, tokens, arena);
+  if (lerr.type != Lexer::Err::Type::OK)
+  {
+    std::cerr << lerr << std::endl;
+    return false;
+  }
+  Preprocesser::Const_Map const_map;
+  Preprocesser::Map file_map;
+  vector<Preprocesser::Unit> units;
+  Preprocesser::Tree tree;
+  Preprocesser::Err *perr = Preprocesser::preprocess(
+      Slice<Lexer::Token *>{tokens.data(), tokens.size()}, units, tree, arena,
+      const_map, file_map);
+  if (perr)
+  {
+    std::cerr << *perr << std::endl;
+    return false;
+  }
+  FILE *fp = pool ? tmpfile() : nullptr;
+  if (pool && !fp)
+  {
+    std::cerr << "ERROR: could not open a temporary file" << std::endl;
+    return false;
+  }
+  vector<uint8_t> bytecode;
+  bool written     = true;
+  auto start       = Clock::now();
+  Parser::Err *err = pool ? Parser::assemble(units, tree, fileno(fp), *pool,
+                                             written, arena)
+                          : Parser::assemble(units, tree, bytecode, arena);
+  result.seconds   = since(start);
+  if (fp)
+    fclose(fp);
+  result.bytes     = Lexer::get_file(file).source.size();
+  result.tokens    = tokens.size();
+  add_includes(file_map, result);
+  if (err)
+    std::cerr << *err << std::endl;
+  else if (!written)
+    std::cerr << "ERROR: could not write bytecode" << std::endl;
+  arena.free();
+  return err == nullptr && written;
+}
+
+// Whether tokens `a` and `b` are the same lexeme at the same position
+bool same(const Lexer::Token *a, const Lexer::Token *b)
+{
+  const auto x = a->position(), y = b->position();
+  return a->type == b->type && a->operand_type == b->operand_type &&
+         a->lexeme() == b->lexeme() && x.line == y.line &&
+         x.column == y.column;
+}
+
+// Whether `document` holds what lexing and preprocessing its source afresh
+// does: the same tokens, and the same units or errors
+bool matches(const Incremental::Document &document, const string &name)
+{
+  Arena arena;
+  const string source = document.source();
+  uint16_t file       = Lexer::add_file(name, Source{source});
+  vector<Lexer::Token *> tokens;
+  Lexer::Err lerr = tokenise_buffer(file, tokens, arena);
+  Preprocesser::Const_Map const_map;
+  Preprocesser::Map file_map;
+  vector<Preprocesser::Unit> units;
+  Preprocesser::Tree tree;
+  Preprocesser::Err *err = nullptr;
+  if (lerr.type == Lexer::Err::Type::OK)
+    err = Preprocesser::preprocess(
+        Slice<Lexer::Token *>{tokens.data(), tokens.size()}, units, tree, arena,
+        const_map, file_map);
+
+  const auto doc_tokens = document.tokens();
+  const auto doc_units  = document.units();
+  const string lex_err  = Lexer::to_string(lerr);
+  bool ok = lex_err == Lexer::to_string(document.lexer_error()) &&
+            tokens.size() == doc_tokens.size() &&
+            std::equal(tokens.begin(), tokens.end(), doc_tokens.begin(), same);
+  if (ok && lerr.type == Lexer::Err::Type::OK && (err || document.error()))
+    ok = err && document.error() &&
+         Preprocesser::to_string(*err) ==
+             Preprocesser::to_string(*document.error());
+  else if (ok && lerr.type == Lexer::Err::Type::OK)
+  {
+    Preprocesser::Walk fresh{tree, {units.data(), units.size()}},
+        edited{document.tree(), {doc_units.data(), doc_units.size()}};
+    int depth = 0, doc_depth = 0;
+    const Preprocesser::Unit *unit = nullptr, *doc_unit = nullptr;
+    do
+    {
+      unit     = fresh.next(depth);
+      doc_unit = edited.next(doc_depth);
+      ok = (!unit && !doc_unit) || (unit && doc_unit && depth == doc_depth &&
+                                    same(unit->root, doc_unit->root));
+    } while (ok && unit);
+  }
+  arena.free();
+  if (!ok)
+    std::cerr << "ERROR: edited document differs from its source processed "
+                 "afresh"
+              << std::endl;
+  return ok;
+}
+
+// Edits to a document kept lexed and preprocessed, as an editor makes them:
+// lines inserted at random in the latter half of the source.  Each piece of a
+// document takes a file of the lexer's table, so one is built per process and
+// checked against processing its source afresh after the first run.
+// Reported as the time per edit.
+bool edit(uint16_t file, Thread_Pool *, Result &result)
+{
+  static std::unique_ptr<Incremental::Document> document;
+  static std::mt19937 rng{1};
+  static bool checked = false;
+  const auto &f       = Lexer::get_file(file);
+  if (!document)
+    document = std::make_unique<Incremental::Document>(
+        f.name, Source{string{f.source}});
+
+  // Edits are made from the end, so the lines found beforehand stay put
+  const string source = document->source();
+  vector<size_t> lines;
+  for (size_t i = 0; i < BENCH_EDITS; ++i)
+  {
+    size_t line = source.find('\n', source.size() / 2 +
+                                        rng() % (source.size() / 2 + 1));
+    lines.push_back(line == string::npos ? source.size() : line + 1);
+  }
+  std::sort(lines.rbegin(), lines.rend());
+
+  auto start = Clock::now();
+  for (const auto line : lines)
+    document->edit(line, line, "noop\n");
+  result.seconds    = since(start);
+  result.bytes      = 0;
+  result.tokens     = 0;
+  result.operations = BENCH_EDITS;
+  if (checked)
+    return true;
+  checked = true;
+  return matches(*document, f.name);
+}
+
+struct Case
+{
+  const char *name;
+  Benchmark run;
+  bool parallel;
+};
+
+static const Case cases[] = {
+    {"tokenise_buffer", lex, false},
+    {"tokenise_buffer-pool", lex, true},
+    {"preprocess", preprocess, false},
+    {"stream+preprocess", stream, false},
+    {"stream+preprocess-pool", stream, true},
+    {"stream-batches", batches, false},
+    {"assemble", assemble, false},
+    {"assemble-pool", assemble, true},
+    {"edit", edit, false},
+};
+
+// Run `c` over `corpus` in a child process, so peak RSS is that of the
+// benchmark alone and state (e.g. interned symbols) doesn't leak between
+// benchmarks.
+bool run_case(const Options &options, const Case &c, const char *corpus,
+              Result &result, long &peak_rss)
+{
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+  else if (pid == 0)
+  {
+    close(fds[0]);
+    auto source = read_file(corpus);
+    if (!source.has_value())
+    {
+      fprintf(stderr, "ERROR: file `%s` does not exist!\n", corpus);
+      _exit(1);
+    }
+    Result best{0, 0, 0, 0};
+    uint16_t file = Lexer::add_file(corpus, std::move(source.value()));
+    Thread_Pool pool{c.parallel ? options.threads : 0};
+    double total = 0;
+    for (size_t runs = 0; runs < BENCH_MAX_RUNS &&
+                          (runs < BENCH_MIN_RUNS || total < BENCH_MIN_TIME);
+         ++runs)
+    {
+      Result r{0, 0, 0, 0};
+      if (!c.run(file, c.parallel ? &pool : nullptr, r))
+        _exit(1);
+      total += r.seconds;
+      if (runs == 0 || r.seconds < best.seconds)
+        best.seconds = r.seconds;
+      best.bytes      = r.bytes;
+      best.tokens     = r.tokens;
+      best.operations = r.operations;
+    }
+    bool ok = write(fds[1], &best, sizeof(best)) == sizeof(best);
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool ok = read(fds[0], &result, sizeof(result)) == sizeof(result);
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    ok = false;
+  peak_rss = usage.ru_maxrss;
+  return ok;
+}
+
+// Print the change in each benchmark between two result files, matched on
+// corpus and benchmark.
+int compare(const char *old_name, const char *new_name)
+{
+  typedef std::pair<string, string> Key;
+  auto load = [](const char *name, std::map<Key, vector<string>> &rows)
+  {
+    std::ifstream fp{name};
+    if (!fp)
+    {
+      fprintf(stderr, "ERROR: file `%s` does not exist!\n", name);
+      return false;
+    }
+    string line;
+    std::getline(fp, line);
+    while (std::getline(fp, line))
+    {
+      vector<string> fields;
+      std::stringstream ss{line};
+      for (string field; std::getline(ss, field, '\t');)
+        fields.push_back(field);
+      if (fields.size() >= 10)
+        rows[{fields[1], fields[2]}] = fields;
+    }
+    return true;
+  };
+
+  std::map<Key, vector<string>> old_rows, new_rows;
+  if (!load(old_name, old_rows) || !load(new_name, new_rows))
+    return 1;
+
+  // Benchmarks of operations have no throughput, so their time per operation
+  // is compared after the rest
+  auto per_op = [](const vector<string> &row)
+  { return row.size() > 10 ? std::stod(row[10]) : 0; };
+  vector<Key> timed;
+
+  printf("%-14s %-24s %10s %10s %8s %10s %10s %8s\n", "corpus", "benchmark",
+         "old MB/s", "new MB/s", "change", "old KiB", "new KiB", "change");
+  for (const auto &[key, row] : new_rows)
+  {
+    auto it = old_rows.find(key);
+    if (it == old_rows.end())
+      continue;
+    else if (per_op(row) > 0)
+    {
+      if (per_op(it->second) > 0)
+        timed.push_back(key);
+      continue;
+    }
+    double old_speed = std::stod(it->second[7]), new_speed = std::stod(row[7]);
+    double old_rss = std::stod(it->second[9]), new_rss = std::stod(row[9]);
+    printf("%-14s %-24s %10.1f %10.1f %+7.1f%% %10.0f %10.0f %+7.1f%%\n",
+           key.first.c_str(), key.second.c_str(), old_speed, new_speed,
+           100 * (new_speed / old_speed - 1), old_rss, new_rss,
+           100 * (new_rss / old_rss - 1));
+  }
+
+  if (!timed.empty())
+    printf("\n%-14s %-24s %10s %10s %8s\n", "corpus", "benchmark",
+           "old us/op", "new us/op", "change");
+  for (const auto &key : timed)
+  {
+    double old_time = per_op(old_rows[key]), new_time = per_op(new_rows[key]);
+    printf("%-14s %-24s %10.2f %10.2f %+7.1f%%\n", key.first.c_str(),
+           key.second.c_str(), old_time, new_time,
+           100 * (new_time / old_time - 1));
+  }
+  return 0;
+}
+
+void usage(const char *program_name, FILE *fp)
+{
+  fprintf(fp,
+          "Usage: %s [OPTIONS] DIRECTORY\n"
+          "       %s -c OLD NEW\n"
+          "\tDIRECTORY: Corpus to benchmark, as generated by corpus.out\n"
+          "\tOLD, NEW: Results to compare\n"
+          "Options:\n"
+          "\t-jN: Use N threads for parallel benchmarks\n"
+          "\t-r REVISION: Revision to record in the results\n"
+          "Results are written to standard output, tab separated, one line "
+          "per benchmark.\n",
+          program_name, program_name);
+}
+
+int main(int argc, const char *argv[])
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    string_view arg{argv[i]};
+    if (arg == "-c" && argc - i == 3)
+      return compare(argv[i + 1], argv[i + 2]);
+    else if (arg == "-r" && i + 1 < argc)
+      options.revision = argv[++i];
+    else if (arg.size() > 2 && arg.substr(0, 2) == "-j")
+    {
+      char *end;
+      options.threads = strtoul(argv[i] + 2, &end, 10);
+      if (*end != '\0')
+      {
+        usage(argv[0], stderr);
+        return -1;
+      }
+    }
+    else if (arg.size() > 0 && arg[0] != '-' && !options.directory)
+      options.directory = argv[i];
+    else
+    {
+      usage(argv[0], stderr);
+      return -1;
+    }
+  }
+  if (!options.directory)
+  {
+    usage(argv[0], stderr);
+    return -1;
+  }
+  // %use's in the corpus are relative to it
+  if (chdir(options.directory) != 0)
+  {
+    fprintf(stderr, "ERROR: directory `%s` does not exist!\n",
+            options.directory);
+    return -1;
+  }
+
+  printf("revision\tcorpus\tbenchmark\tthreads\tbytes\ttokens\tseconds\tmb_per_"
+         "s\ttokens_per_s\tpeak_rss_kb\tus_per_op\n");
+  fprintf(stderr, "%-14s %-24s %10s %12s %10s %10s\n", "corpus", "benchmark",
+          "MB/s", "tokens/s", "peak KiB", "us/op");
+  int ret = 0;
+  for (auto corpus : corpora)
+    for (const auto &c : cases)
+    {
+      Result result;
+      long peak_rss;
+      if (!run_case(options, c, corpus, result, peak_rss))
+      {
+        fprintf(stderr, "ERROR: benchmark `%s` failed on `%s`\n", c.name,
+                corpus);
+        ret = 1;
+        continue;
+      }
+      double mb_per_s     = result.bytes / result.seconds / 1e6;
+      double tokens_per_s = result.tokens / result.seconds;
+      double us_per_op =
+          result.operations ? result.seconds / result.operations * 1e6 : 0;
+      printf("%s\t%s\t%s\t%lu\t%lu\t%lu\t%.6f\t%.3f\t%.0f\t%ld\t%.3f\n",
+             options.revision, corpus, c.name, c.parallel ? options.threads : 0,
+             result.bytes, result.tokens, result.seconds, mb_per_s,
+             tokens_per_s, peak_rss, us_per_op);
+      fprintf(stderr, "%-14s %-24s %10.1f %12.0f %10ld %10.2f\n", corpus,
+              c.name, mb_per_s, tokens_per_s, peak_rss, us_per_op);
+      fflush(stdout);
+    }
+  return ret;
+}
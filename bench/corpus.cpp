@@ -0,0 +1,361 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Generator of synthetic source files for benchmarking
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <src/preprocesser.hpp>
+
+using std::string, std::string_view, std::vector;
+
+// Number of files %use'd by the main file of the include graph, and the number
+// of files shared between them
+#define CORPUS_USE_WIDTH  64
+#define CORPUS_USE_SHARED 8
+
+static const char *types[] = {"byte", "hword", "word"};
+
+// Instructions which take no operand and leave the stack as they found it, or
+// consume what the previous instruction pushed
+static const char *nullary[] = {"noop", "pop.byte", "pop.hword", "pop.word",
+                                "not.byte", "not.word", "print.byte",
+                                "print.word", "print.long", "msize"};
+
+// Every corpus is generated from a fixed seed, so the same size always gives
+// the same files and results are comparable between commits.
+struct Generator
+{
+  std::mt19937_64 rng{0xAA1};
+  string out;
+
+  size_t below(size_t n)
+  {
+    return rng() % n;
+  }
+
+  const char *type()
+  {
+    return types[below(3)];
+  }
+
+  void line(string_view s)
+  {
+    out += "  ";
+    out += s;
+    out += '\n';
+  }
+
+  void instruction(size_t labels)
+  {
+    char buffer[64];
+    switch (below(8))
+    {
+    case 0:
+    case 1:
+    {
+      const char *t = type();
+      snprintf(buffer, sizeof(buffer), "push.%s %lu", t,
+               below(t == types[0] ? 1 << 8 : 1 << 16));
+      break;
+    }
+    case 2:
+      snprintf(buffer, sizeof(buffer), "push.reg.%s %lu", type(), below(8));
+      break;
+    case 3:
+      snprintf(buffer, sizeof(buffer), "mov.%s %lu", type(), below(8));
+      break;
+    case 4:
+      snprintf(buffer, sizeof(buffer), "plus.%s", type());
+      break;
+    case 5:
+      snprintf(buffer, sizeof(buffer), "%s", nullary[below(10)]);
+      break;
+    case 6:
+      snprintf(buffer, sizeof(buffer), "jump.if.%s label_%lu", type(),
+               below(labels));
+      break;
+    default:
+      snprintf(buffer, sizeof(buffer), "call label_%lu", below(labels));
+      break;
+    }
+    line(buffer);
+  }
+
+  bool write(const string &dir, const char *name)
+  {
+    string path = dir + "/" + name;
+    FILE *fp    = fopen(path.c_str(), "wb");
+    if (!fp)
+    {
+      fprintf(stderr, "ERROR: could not open `%s`\n", path.c_str());
+      return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    ok      = fclose(fp) == 0 && ok;
+    out.clear();
+    return ok;
+  }
+};
+
+// A huge stream of plain instructions and labels, no preprocessing to do
+bool flat(Generator &g, const string &dir, size_t size)
+{
+  const size_t labels = size / 4096 + 1;
+  g.line("global label_0");
+  size_t label = 0;
+  for (; g.out.size() < size; ++label)
+  {
+    if (label < labels)
+      g.out += "label_" + std::to_string(label) + ":\n";
+    for (size_t i = 0, n = 8 + g.below(32); i < n; ++i)
+      g.instruction(labels);
+    g.line("ret");
+  }
+  // Every label referred to must be defined
+  for (; label < labels; ++label)
+  {
+    g.out += "label_" + std::to_string(label) + ":\n";
+    g.line("ret");
+  }
+  return g.write(dir, "flat.asm");
+}
+
+// Chains of constants each referring to the last, as deep as the preprocesser
+// allows, referred to from the top of each chain.
+bool nested(Generator &g, const string &dir, size_t size)
+{
+  const size_t chains = 16;
+  const size_t depth  = PREPROCESSER_MAX_DEPTH - 1;
+  char buffer[64];
+  for (size_t chain = 0; chain < chains; ++chain)
+    for (size_t level = 0; level < depth; ++level)
+    {
+      g.out += "%const chain_" + std::to_string(chain) + "_" +
+               std::to_string(level) + "\n";
+      if (level > 0)
+        g.line("$chain_" + std::to_string(chain) + "_" +
+               std::to_string(level - 1));
+      snprintf(buffer, sizeof(buffer), "push.%s %lu", g.type(), level);
+      g.line(buffer);
+      g.out += "%end\n";
+    }
+  g.line("global main");
+  g.out += "main:\n";
+  while (g.out.size() < size)
+  {
+    g.line("$chain_" + std::to_string(g.below(chains)) + "_" +
+           std::to_string(depth - 1 - g.below(4)));
+    g.instruction(1);
+  }
+  g.out += "label_0:\n";
+  g.line("halt");
+  return g.write(dir, "nested.asm");
+}
+
+// A wide graph of includes: the main file uses every library, and each library
+// uses a few of the shared files, so most %use's are repeats.  Each file
+// exports constants which the main file refers to.
+bool uses(Generator &g, const string &dir, size_t size)
+{
+  const size_t file_size = size / (CORPUS_USE_WIDTH + CORPUS_USE_SHARED) + 1;
+  char name[64];
+
+  auto body = [&](const string &prefix, size_t size)
+  {
+    for (size_t i = 0; g.out.size() < size; ++i)
+    {
+      g.out += "%const " + prefix + "_" + std::to_string(i) + "\n";
+      for (size_t j = 0, n = 1 + g.below(4); j < n; ++j)
+        g.instruction(1);
+      g.out += "%end\n";
+    }
+  };
+
+  for (size_t i = 0; i < CORPUS_USE_SHARED; ++i)
+  {
+    body("shared_" + std::to_string(i), file_size);
+    snprintf(name, sizeof(name), "use-shared-%lu.asm", i);
+    if (!g.write(dir, name))
+      return false;
+  }
+
+  for (size_t i = 0; i < CORPUS_USE_WIDTH; ++i)
+  {
+    for (size_t j = 0; j < 3; ++j)
+      g.out += "%use \"use-shared-" +
+               std::to_string(g.below(CORPUS_USE_SHARED)) + ".asm\"\n";
+    body("lib_" + std::to_string(i), file_size);
+    snprintf(name, sizeof(name), "use-lib-%lu.asm", i);
+    if (!g.write(dir, name))
+      return false;
+  }
+
+  for (size_t i = 0; i < CORPUS_USE_WIDTH; ++i)
+    g.out += "%use \"use-lib-" + std::to_string(i) + ".asm\"\n";
+  g.line("global main");
+  g.out += "main:\n";
+  for (size_t i = 0; i < CORPUS_USE_WIDTH * 16; ++i)
+  {
+    if (g.below(4) == 0)
+      g.line("$shared_" + std::to_string(g.below(CORPUS_USE_SHARED)) + "_0");
+    else
+      g.line("$lib_" + std::to_string(g.below(CORPUS_USE_WIDTH)) + "_0");
+  }
+  g.out += "label_0:\n";
+  g.line("halt");
+  return g.write(dir, "use-main.asm");
+}
+
+// Mostly comments and blank lines, with the odd instruction between them
+bool comments(Generator &g, const string &dir, size_t size)
+{
+  static const char *words[] = {"push",   "the",     "register", "onto",
+                                "stack",  "counter", "of",       "loop",
+                                "return", "address", "bound",    "memory"};
+  g.line("global main");
+  g.out += "main:\n";
+  while (g.out.size() < size)
+  {
+    switch (g.below(4))
+    {
+    case 0:
+      g.out += '\n';
+      break;
+    case 1:
+      g.instruction(1);
+      break;
+    default:
+      g.out += string(1 + g.below(3), ';');
+      for (size_t i = 0, n = 4 + g.below(12); i < n; ++i)
+      {
+        g.out += ' ';
+        g.out += words[g.below(12)];
+      }
+      g.out += '\n';
+      break;
+    }
+  }
+  g.out += "label_0:\n";
+  g.line("halt");
+  return g.write(dir, "comments.asm");
+}
+
+// Every form of literal an operand can take
+bool literals(Generator &g, const string &dir, size_t size)
+{
+  static const char *chars[] = {"'a'",  "'Z'",  "'0'",  "' '",  "'\\n'",
+                                "'\\t'", "'\\r'", "'\\\\'", "'#'", "'~'"};
+  char buffer[64];
+  g.line("global main");
+  g.out += "main:\n";
+  while (g.out.size() < size)
+  {
+    switch (g.below(4))
+    {
+    case 0:
+      snprintf(buffer, sizeof(buffer), "push.byte %s", chars[g.below(10)]);
+      break;
+    case 1:
+      snprintf(buffer, sizeof(buffer), "push.word -%lu", g.below(1UL << 31));
+      break;
+    case 2:
+      snprintf(buffer, sizeof(buffer), "push.hword %lu", g.below(1UL << 32));
+      break;
+    default:
+      snprintf(buffer, sizeof(buffer), "push.%s %lu", g.type(),
+               g.below(1UL << 8));
+      break;
+    }
+    g.line(buffer);
+    g.line("pop.byte");
+  }
+  g.out += "label_0:\n";
+  g.line("halt");
+  return g.write(dir, "literals.asm");
+}
+
+// Calls to macros and references to constants, some from inside the macros,
+// with no labels to keep: streaming it should hold no more than a batch of
+// units however many calls there are.
+bool macros(Generator &g, const string &dir, size_t size)
+{
+  char buffer[64];
+  g.out += "%const one\n";
+  g.line("push.byte 1");
+  g.out += "%end\n";
+  g.out += "%macro(add_pair)(a b)\n";
+  g.line("push.byte a");
+  g.line("push.byte b");
+  g.line("plus.byte");
+  g.out += "%end\n";
+  g.out += "%macro(add_one)(a)\n";
+  g.line("push.byte a");
+  g.line("$one");
+  g.line("plus.byte");
+  g.out += "%end\n";
+  g.line("global main");
+  g.out += "main:\n";
+  while (g.out.size() < size)
+  {
+    switch (g.below(4))
+    {
+    case 0:
+      g.line("$one");
+      break;
+    case 1:
+      snprintf(buffer, sizeof(buffer), "$add_one %lu", g.below(1 << 8));
+      g.line(buffer);
+      break;
+    default:
+      snprintf(buffer, sizeof(buffer), "$add_pair %lu %lu", g.below(1 << 8),
+               g.below(1 << 8));
+      g.line(buffer);
+      break;
+    }
+    g.line("pop.byte");
+  }
+  g.line("halt");
+  return g.write(dir, "macros.asm");
+}
+
+int main(int argc, const char *argv[])
+{
+  if (argc < 2 || argc > 3)
+  {
+    fprintf(stderr,
+            "Usage: %s DIRECTORY [SIZE]\n"
+            "\tDIRECTORY: Where to write the corpus\n"
+            "\tSIZE: Approximate size of each file set in MiB (default 16)\n",
+            argv[0]);
+    return -1;
+  }
+  string dir  = argv[1];
+  size_t size = (argc == 3 ? strtoul(argv[2], nullptr, 10) : 16) << 20;
+  mkdir(dir.c_str(), 0755);
+
+  Generator g;
+  if (!flat(g, dir, size) || !nested(g, dir, size / 4) ||
+      !uses(g, dir, size / 4) || !comments(g, dir, size / 2) ||
+      !literals(g, dir, size / 2) || !macros(g, dir, size / 2))
+    return 1;
+  return 0;
+}
@@ -0,0 +1,123 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Bump allocator for compilation lifetime objects
+ */
+
+#include <src/arena.hpp>
+
+#include <cstdlib>
+
+Arena::Arena()
+    : blocks{nullptr}, finalisers{nullptr}, head{nullptr}, limit{nullptr}
+{
+}
+
+Arena::~Arena()
+{
+  free();
+}
+
+static void *align_up(void *ptr, size_t align)
+{
+  return reinterpret_cast<void *>(
+      (reinterpret_cast<uintptr_t>(ptr) + align - 1) & ~(align - 1));
+}
+
+void *Arena::grow(size_t size, size_t align)
+{
+  const size_t required = sizeof(Block) + size + align;
+  const size_t capacity =
+      required < ARENA_BLOCK_SIZE ? ARENA_BLOCK_SIZE : required;
+
+  Block *block = static_cast<Block *>(malloc(capacity));
+  if (!block)
+    throw std::bad_alloc{};
+  block->size = capacity;
+
+  // Oversized requests get a block of their own, placed behind the current
+  // one so the rest of the current block isn't wasted.
+  if (blocks && required > ARENA_BLOCK_SIZE / 4)
+  {
+    block->next  = blocks->next;
+    blocks->next = block;
+    return align_up(block + 1, align);
+  }
+
+  block->next = blocks;
+  blocks      = block;
+  head        = reinterpret_cast<char *>(block + 1);
+  limit       = reinterpret_cast<char *>(block) + capacity;
+  return allocate(size, align);
+}
+
+void Arena::add_finaliser(void *object, void (*fn)(void *))
+{
+  Finaliser *finaliser = static_cast<Finaliser *>(
+      allocate(sizeof(Finaliser), alignof(Finaliser)));
+  *finaliser = {fn, object, finalisers};
+  finalisers = finaliser;
+}
+
+void Arena::adopt(Arena &other)
+{
+  if (!other.blocks)
+    return;
+
+  // Other's blocks go behind our current block so allocation carries on
+  // where it was.
+  Block *last = other.blocks;
+  while (last->next)
+    last = last->next;
+  if (blocks)
+  {
+    last->next   = blocks->next;
+    blocks->next = other.blocks;
+  }
+  else
+  {
+    blocks = other.blocks;
+    head   = other.head;
+    limit  = other.limit;
+  }
+
+  if (other.finalisers)
+  {
+    Finaliser *tail = other.finalisers;
+    while (tail->next)
+      tail = tail->next;
+    tail->next = finalisers;
+    finalisers = other.finalisers;
+  }
+
+  other.blocks     = nullptr;
+  other.finalisers = nullptr;
+  other.head = other.limit = nullptr;
+}
+
+void Arena::free()
+{
+  // Finalisers are a stack, so objects are destroyed in reverse order of
+  // construction.
+  for (Finaliser *f = finalisers; f; f = f->next)
+    f->fn(f->object);
+  finalisers = nullptr;
+
+  for (Block *block = blocks, *next; block; block = next)
+  {
+    next = block->next;
+    std::free(block);
+  }
+  blocks = nullptr;
+  head = limit = nullptr;
+}
@@ -0,0 +1,166 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Bump allocator for compilation lifetime objects
+ */
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// A view over a contiguous sequence of objects, usually owned by an Arena.
+template <typename T>
+struct Slice
+{
+  Slice() : ptr{nullptr}, count{0}
+  {
+  }
+
+  Slice(T *data, size_t size) : ptr{data}, count{size}
+  {
+  }
+
+  T *data() const
+  {
+    return ptr;
+  }
+
+  size_t size() const
+  {
+    return count;
+  }
+
+  T *begin() const
+  {
+    return ptr;
+  }
+
+  T *end() const
+  {
+    return ptr + count;
+  }
+
+  T &operator[](size_t i) const
+  {
+    return ptr[i];
+  }
+
+private:
+  T *ptr;
+  size_t count;
+};
+
+// Owner of every object that lives as long as the compilation (tokens, errors,
+// units, constant bodies).  Allocation bumps a pointer through large blocks;
+// nothing is freed individually, instead free() releases everything at once,
+// running destructors for objects which need them.
+struct Arena
+{
+  Arena();
+  ~Arena();
+  Arena(const Arena &)            = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t size, size_t align)
+  {
+    auto ptr = (reinterpret_cast<uintptr_t>(head) + align - 1) & ~(align - 1);
+    if (!head || ptr + size > reinterpret_cast<uintptr_t>(limit))
+      return grow(size, align);
+    head = reinterpret_cast<char *>(ptr + size);
+    return reinterpret_cast<void *>(ptr);
+  }
+
+  template <typename T, typename... Args>
+  T *make(Args &&...args)
+  {
+    T *obj =
+        new (allocate(sizeof(T), alignof(T))) T{std::forward<Args>(args)...};
+    if constexpr (!std::is_trivially_destructible_v<T>)
+      add_finaliser(obj, [](void *ptr) { static_cast<T *>(ptr)->~T(); });
+    return obj;
+  }
+
+  template <typename T>
+  Slice<T> make_slice(size_t size)
+  {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "Arena slices must be trivially destructible");
+    if (size == 0)
+      return {};
+    T *data = static_cast<T *>(allocate(sizeof(T) * size, alignof(T)));
+    for (size_t i = 0; i < size; ++i)
+      new (data + i) T{};
+    return {data, size};
+  }
+
+  template <typename It>
+  auto copy(It begin, It end)
+  {
+    using T = std::remove_const_t<std::remove_reference_t<decltype(*begin)>>;
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "Arena slices must be trivially destructible");
+    const size_t size = std::distance(begin, end);
+    if (size == 0)
+      return Slice<T>{};
+    T *data = static_cast<T *>(allocate(sizeof(T) * size, alignof(T)));
+    std::uninitialized_copy(begin, end, data);
+    return Slice<T>{data, size};
+  }
+
+  template <typename T>
+  Slice<T> copy(const std::vector<T> &vec)
+  {
+    return copy(vec.begin(), vec.end());
+  }
+
+  // Run all destructors and release every block.  The arena may be reused
+  // afterwards.
+  void free();
+
+  // Take ownership of everything allocated in `other`, leaving it empty.  Used
+  // to merge arenas filled by separate threads.
+  void adopt(Arena &other);
+
+private:
+  struct Block
+  {
+    Block *next;
+    size_t size;
+  };
+
+  struct Finaliser
+  {
+    void (*fn)(void *);
+    void *object;
+    Finaliser *next;
+  };
+
+  Block *blocks;
+  Finaliser *finalisers;
+  char *head, *limit;
+
+  void *grow(size_t size, size_t align);
+  void add_finaliser(void *object, void (*fn)(void *));
+};
+
+#endif
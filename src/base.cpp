@@ -16,22 +16,135 @@
 
 #include <src/base.hpp>
 
-#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-std::optional<std::string> read_file(const char *filename)
+Source::Source() : map{nullptr}, map_size{0}
 {
-  FILE *fp = fopen(filename, "rb");
-  if (fp)
+}
+
+Source::Source(std::string buffer)
+    : map{nullptr}, map_size{0}, buffer{std::move(buffer)}
+{
+}
+
+Source::Source(Source &&other)
+    : map{other.map}, map_size{other.map_size}, buffer{std::move(other.buffer)}
+{
+  other.map      = nullptr;
+  other.map_size = 0;
+}
+
+Source &Source::operator=(Source &&other)
+{
+  if (this != &other)
   {
-    std::string contents;
-    fseek(fp, 0, SEEK_END);
-    contents.resize(ftell(fp));
-    rewind(fp);
-    fread(&contents[0], 1, contents.size(), fp);
-    fclose(fp);
-
-    return contents;
+    if (map)
+      munmap(map, map_size);
+    map            = other.map;
+    map_size       = other.map_size;
+    buffer         = std::move(other.buffer);
+    other.map      = nullptr;
+    other.map_size = 0;
   }
-  else
+  return *this;
+}
+
+Source::~Source()
+{
+  if (map)
+    munmap(map, map_size);
+}
+
+std::string_view Source::view() const
+{
+  if (map)
+    return {static_cast<const char *>(map), map_size};
+  return buffer;
+}
+
+void Source::replace(size_t begin, size_t end, std::string_view text)
+{
+  if (map)
+  {
+    buffer = std::string{view()};
+    munmap(map, map_size);
+    map      = nullptr;
+    map_size = 0;
+  }
+  buffer.replace(begin, end - begin, text);
+}
+
+void Source::drop(size_t end) const
+{
+  const size_t page = sysconf(_SC_PAGESIZE);
+  if (map && end >= page)
+    madvise(map, end & ~(page - 1), MADV_DONTNEED);
+}
+
+std::optional<Source> read_fd(int fd)
+{
+  std::string contents;
+  size_t size = 0;
+  while (true)
+  {
+    contents.resize(size + READ_CHUNK_SIZE);
+    ssize_t bytes = read(fd, &contents[size], READ_CHUNK_SIZE);
+    if (bytes < 0)
+      return std::nullopt;
+    else if (bytes == 0)
+      break;
+    size += bytes;
+    if (size > SOURCE_MAX_SIZE)
+    {
+      errno = EFBIG;
+      return std::nullopt;
+    }
+  }
+  contents.resize(size);
+  return Source{std::move(contents)};
+}
+
+std::optional<Source> read_file(const char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
     return std::nullopt;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+  {
+    close(fd);
+    return std::nullopt;
+  }
+  else if (static_cast<uint64_t>(st.st_size) > SOURCE_MAX_SIZE)
+  {
+    close(fd);
+    errno = EFBIG;
+    return std::nullopt;
+  }
+
+  std::optional<Source> source;
+  // Can't map empty or non regular files
+  if (!S_ISREG(st.st_mode) || st.st_size == 0)
+    source = read_fd(fd);
+  else
+  {
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+      source = read_fd(fd);
+    else
+    {
+      // Sources are lexed front to back
+      madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+      source           = Source{};
+      source->map      = ptr;
+      source->map_size = st.st_size;
+    }
+  }
+  close(fd);
+  return source;
 }
@@ -17,9 +17,49 @@
 #ifndef BASE_HPP
 #define BASE_HPP
 
+#include <cstdint>
 #include <optional>
 #include <string>
+#include <string_view>
 
-std::optional<std::string> read_file(const char *);
+#define READ_CHUNK_SIZE (64 * 1024)
+// Largest source which may be read, as tokens are placed by 32 bit offsets
+#define SOURCE_MAX_SIZE UINT32_MAX
+
+// Read only contents of a file.  Regular files are memory mapped, anything else
+// (e.g. a pipe) is read in chunks into a single owned buffer.  Files larger
+// than SOURCE_MAX_SIZE aren't read, failing with errno set to EFBIG.
+struct Source;
+std::optional<Source> read_file(const char *);
+
+struct Source
+{
+  Source();
+  Source(std::string buffer);
+  Source(Source &&);
+  Source &operator=(Source &&);
+  Source(const Source &)            = delete;
+  Source &operator=(const Source &) = delete;
+  ~Source();
+
+  std::string_view view() const;
+  // Replace view()[begin, end) with text.  Mapped contents are copied into an
+  // owned buffer first.
+  void replace(size_t begin, size_t end, std::string_view text);
+  // Let view()[0, end) be dropped from memory, for sources read once front to
+  // back.  Mapped pages are read back in if used again.
+  void drop(size_t end) const;
+
+private:
+  void *map;
+  size_t map_size;
+  std::string buffer;
+
+  friend std::optional<Source> read_file(const char *);
+};
+
+// Read a file descriptor until end of file, e.g. standard input.  Fails with
+// errno set to EFBIG past SOURCE_MAX_SIZE bytes.
+std::optional<Source> read_fd(int fd);
 
 #endif
@@ -0,0 +1,206 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: On disk cache of the tokens of source files
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <src/base.hpp>
+#include <src/cache.hpp>
+
+using Lexer::Token;
+
+// Entries are a header, then a record per token.  Offsets are those of the
+// source, which is read alongside, so an entry holds no text.  Symbols are
+// interned again on load: a record of a symbol or reference holds the index of
+// the first record with the same name, so each name is interned only once.
+struct Header
+{
+  char magic[4];
+  uint32_t format;
+  uint64_t key[2];
+  uint64_t source_size;
+  uint32_t tokens;
+  uint32_t err_offset;
+  Lexer::Err::Type err_type;
+};
+
+struct Record
+{
+  Token::Type type;
+  Token::OperandType operand_type;
+  uint32_t offset, size;
+  uint32_t first;
+};
+
+static const char magic[4] = {'A', 'A', 'L', 'C'};
+
+// 128 bit hash of `data`, a word at a time in two independent lanes.  Not
+// cryptographic; it only has to tell apart versions of the same file.
+static void hash(std::string_view data, uint64_t h[2])
+{
+  const uint64_t p0 = 0x9E3779B97F4A7C15ULL, p1 = 0xC2B2AE3D27D4EB4FULL;
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, data.data() + i, 8);
+    h[0] = (h[0] ^ word) * p0;
+    h[0] ^= h[0] >> 29;
+    h[1] = (h[1] + word) * p1;
+    h[1] = (h[1] << 31) | (h[1] >> 33);
+  }
+  uint64_t tail = data.size();
+  for (; i < data.size(); ++i)
+    tail = (tail << 8) | static_cast<uint8_t>(data[i]);
+  h[0] = (h[0] ^ tail) * p0;
+  h[1] = (h[1] + tail) * p1;
+  h[0] ^= h[1] >> 32;
+  h[1] ^= h[0] >> 32;
+}
+
+Token_Cache::Token_Cache(std::string directory)
+    : directory{std::move(directory)}, version{CACHE_FORMAT, 0}, usable{false}
+{
+  if (mkdir(this->directory.c_str(), 0755) != 0 && errno != EEXIST)
+    return;
+  // Any change to the assembler changes its executable
+  auto self = read_file("/proc/self/exe");
+  if (!self.has_value())
+    return;
+  hash(self.value().view(), version);
+  usable = true;
+}
+
+bool Token_Cache::enabled() const
+{
+  return usable;
+}
+
+Lexer::Err Token_Cache::tokenise(uint16_t file, std::vector<Token *> &tokens,
+                                 Arena &arena)
+{
+  if (!usable)
+    return Lexer::tokenise_buffer(file, tokens, arena);
+
+  uint64_t key[2] = {version[0], version[1]};
+  hash(Lexer::get_file(file).source, key);
+  char name[40];
+  snprintf(name, sizeof(name), "/%016lx%016lx.tok", key[0], key[1]);
+  const std::string path = directory + name;
+
+  Lexer::Err err;
+  if (load(path, key, file, tokens, err, arena))
+    return err;
+  err = Lexer::tokenise_buffer(file, tokens, arena);
+  store(path, key, file, tokens, err);
+  return err;
+}
+
+bool Token_Cache::load(const std::string &path, const uint64_t key[2],
+                       uint16_t file, std::vector<Token *> &tokens,
+                       Lexer::Err &err, Arena &arena)
+{
+  const auto entry = read_file(path.c_str());
+  if (!entry.has_value())
+    return false;
+  const std::string_view data = entry.value().view();
+  const std::string_view source = Lexer::get_file(file).source;
+
+  Header header;
+  if (data.size() < sizeof(header))
+    return false;
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+      header.format != CACHE_FORMAT || header.key[0] != key[0] ||
+      header.key[1] != key[1] || header.source_size != source.size() ||
+      data.size() != sizeof(header) + header.tokens * sizeof(Record))
+    return false;
+
+  const char *records = data.data() + sizeof(header);
+  Slice<Token> loaded = arena.make_slice<Token>(header.tokens);
+  for (uint32_t i = 0; i < header.tokens; ++i)
+  {
+    Record r;
+    memcpy(&r, records + i * sizeof(Record), sizeof(r));
+    if (r.offset + static_cast<uint64_t>(r.size) > source.size() || r.first > i)
+      return false;
+    Token &t = loaded[i];
+    t        = Token{r.type, file, r.offset, r.size, r.operand_type};
+    if (t.type == Token::Type::SYMBOL || t.type == Token::Type::PP_REFERENCE)
+      t.symbol =
+          r.first == i ? Lexer::intern(t.content()) : loaded[r.first].symbol;
+  }
+  tokens.reserve(tokens.size() + header.tokens);
+  for (auto &t : loaded)
+    tokens.push_back(&t);
+  err = header.err_type == Lexer::Err::Type::OK
+            ? Lexer::Err{}
+            : Lexer::Err{header.err_type, file, header.err_offset};
+  return true;
+}
+
+void Token_Cache::store(const std::string &path, const uint64_t key[2],
+                        uint16_t file, const std::vector<Token *> &tokens,
+                        const Lexer::Err &err)
+{
+  static std::atomic<unsigned> temporaries{0};
+
+  // Zeroed so padding is written out deterministically
+  Header header{};
+  memcpy(header.magic, magic, sizeof(magic));
+  header.format      = CACHE_FORMAT;
+  header.key[0]      = key[0];
+  header.key[1]      = key[1];
+  header.source_size = Lexer::get_file(file).source.size();
+  header.tokens      = tokens.size();
+  header.err_offset  = err.offset;
+  header.err_type    = err.type;
+
+  std::string data{reinterpret_cast<const char *>(&header), sizeof(header)};
+  data.resize(sizeof(header) + tokens.size() * sizeof(Record));
+  std::unordered_map<uint32_t, uint32_t> firsts;
+  for (uint32_t i = 0; i < tokens.size(); ++i)
+  {
+    const Token &t = *tokens[i];
+    Record r{};
+    r.type         = t.type;
+    r.operand_type = t.operand_type;
+    r.offset       = t.offset;
+    r.size         = t.size;
+    r.first        = i;
+    if (t.type == Token::Type::SYMBOL || t.type == Token::Type::PP_REFERENCE)
+      r.first = firsts.insert({t.symbol, i}).first->second;
+    memcpy(&data[sizeof(header) + i * sizeof(Record)], &r, sizeof(r));
+  }
+
+  // Write to a file of our own and rename it into place, so readers only ever
+  // see whole entries
+  const std::string temporary = path + "." + std::to_string(getpid()) + "." +
+                                std::to_string(temporaries++);
+  FILE *fp = fopen(temporary.c_str(), "wb");
+  if (!fp)
+    return;
+  bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+  ok      = fclose(fp) == 0 && ok;
+  if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+    remove(temporary.c_str());
+}
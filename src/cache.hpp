@@ -0,0 +1,61 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: On disk cache of the tokens of source files
+ */
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <src/arena.hpp>
+#include <src/lexer.hpp>
+
+// Bump when the layout of cache entries changes
+#define CACHE_FORMAT 1
+
+// Tokens of source files kept on disk between runs, like precompiled headers.
+// Entries are keyed by a hash of the contents of the file and of the assembler
+// executable itself, so editing the file or rebuilding the assembler misses
+// the cache rather than using stale tokens.  Entries are written atomically,
+// so one cache may be shared by concurrent runs.
+struct Token_Cache
+{
+  // The cache is disabled if `directory` can't be created or the assembler's
+  // own executable can't be read.
+  Token_Cache(std::string directory);
+
+  bool enabled() const;
+
+  // Tokenise `file` as Lexer::tokenise_buffer does, loading the tokens of the
+  // same contents from the cache if there, storing them in the cache if not.
+  Lexer::Err tokenise(uint16_t file, std::vector<Lexer::Token *> &tokens,
+                      Arena &arena);
+
+private:
+  std::string directory;
+  uint64_t version[2];
+  bool usable;
+
+  bool load(const std::string &path, const uint64_t key[2], uint16_t file,
+            std::vector<Lexer::Token *> &tokens, Lexer::Err &err,
+            Arena &arena);
+  void store(const std::string &path, const uint64_t key[2], uint16_t file,
+             const std::vector<Lexer::Token *> &tokens, const Lexer::Err &err);
+};
+
+#endif
@@ -0,0 +1,1056 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Incremental lexing and preprocessing of an edited source
+ */
+
+#include <src/incremental.hpp>
+
+#include <algorithm>
+
+namespace Incremental
+{
+  using TT  = Lexer::Token::Type;
+  using ET  = Preprocesser::Err::Type;
+  using LET = Lexer::Err::Type;
+  using Preprocesser::Unit;
+
+  static bool is_directive(TT type)
+  {
+    return type == TT::PP_CONST || type == TT::PP_MACRO || type == TT::PP_USE ||
+           type == TT::PP_END || type == TT::PP_REFERENCE;
+  }
+
+  static size_t token_end(const Lexer::Token *token)
+  {
+    return token->offset + token->size;
+  }
+
+  static size_t line_begin(std::string_view source, size_t offset)
+  {
+    if (offset == 0)
+      return 0;
+    const size_t newline = source.rfind('\n', offset - 1);
+    return newline == std::string_view::npos ? 0 : newline + 1;
+  }
+
+  static size_t line_end(std::string_view source, size_t offset)
+  {
+    const size_t newline = source.find('\n', offset);
+    return newline == std::string_view::npos ? source.size() : newline + 1;
+  }
+
+  // Name of the constant or macro an item defines, false if it defines none
+  // or its header is malformed
+  static bool defined_name(const std::vector<Lexer::Token *> &toks,
+                           const Item &item, uint32_t &name)
+  {
+    const size_t i = item.begin;
+    if (item.type == Item::Type::CONST)
+      name = toks[i + 1]->symbol;
+    else if (item.type != Item::Type::MACRO || item.end - i < 4 ||
+             toks[i + 1]->type != TT::LEFT_PAREN ||
+             toks[i + 2]->type != TT::SYMBOL ||
+             toks[i + 3]->type != TT::RIGHT_PAREN)
+      return false;
+    else
+      name = toks[i + 2]->symbol;
+    return true;
+  }
+
+  static bool same(const Preprocesser::Block &a, const Preprocesser::Block &b)
+  {
+    return a.root == b.root && a.parameters == b.parameters &&
+           std::equal(a.body.begin(), a.body.end(), b.body.begin(),
+                      b.body.end()) &&
+           std::equal(a.slots.begin(), a.slots.end(), b.slots.begin(),
+                      b.slots.end());
+  }
+
+  void Sums::assign(const std::vector<size_t> &counts)
+  {
+    tree.assign(counts.size() + 1, 0);
+    for (size_t i = 1; i < tree.size(); ++i)
+    {
+      tree[i] += counts[i - 1];
+      const size_t parent = i + (i & -i);
+      if (parent < tree.size())
+        tree[parent] += tree[i];
+    }
+  }
+
+  void Sums::add(size_t i, int64_t delta)
+  {
+    for (++i; i < tree.size(); i += i & -i)
+      tree[i] += delta;
+  }
+
+  size_t Sums::prefix(size_t i) const
+  {
+    size_t sum = 0;
+    for (; i > 0; i -= i & -i)
+      sum += tree[i];
+    return sum;
+  }
+
+  size_t Sums::find(size_t sum) const
+  {
+    size_t step = 1;
+    while (step * 2 < tree.size())
+      step *= 2;
+    size_t i = 0;
+    for (; step > 0; step /= 2)
+      if (i + step < tree.size() && tree[i + step] <= sum)
+      {
+        i += step;
+        sum -= tree[i];
+      }
+    return i;
+  }
+
+  Document::Document(std::string name, Source source)
+      : name{name}, token_count{0}, lexed{0}, last_use{nullptr}
+  {
+    std::string text{source.view()};
+    const uint16_t file = Lexer::add_file(std::move(name), std::move(source));
+    pieces.push_back(std::make_unique<Piece>(Piece{file, 0, 0, 0, {}, {}, {}}));
+    by_file[file]       = pieces[0].get();
+    Lexer::set_first_line(file, [this, file]() { return first_line(file); });
+    rebuild(std::move(text));
+  }
+
+  Document::~Document()
+  {
+    for (const auto &piece : pieces)
+      Lexer::set_first_line(piece->file, nullptr);
+    for (const auto file : spare)
+      Lexer::set_first_line(file, nullptr);
+  }
+
+  void Document::edit(size_t begin, size_t end, std::string_view text)
+  {
+    if (lexed > 2 * token_count + INCREMENTAL_GARBAGE_LIMIT)
+    {
+      std::string whole = source();
+      whole.replace(begin, end - begin, text);
+      rebuild(std::move(whole));
+      return;
+    }
+
+    // Gather the pieces the edit touches into the one it starts in.  An edit
+    // reaching the end of a piece joins its last line to the next's first.  A
+    // quote added after a string literal left open closes it, so the piece
+    // holding that is taken in too.
+    const size_t at = begin;
+    size_t k        = std::min(sizes.find(begin), pieces.size() - 1);
+    if (text.find('"') != std::string_view::npos)
+      k = std::min(k, open_piece());
+    while (k + 1 < pieces.size() && end >= sizes.prefix(k + 1))
+      merge(k, pieces[k]->tokens.size());
+    Piece &piece = *pieces[k];
+    auto &toks   = piece.tokens;
+    begin -= sizes.prefix(k);
+    end -= sizes.prefix(k);
+
+    // Find the whole lines touched by the edit, widened until no token crosses
+    // their boundaries, and the tokens within them.  The tokens of a piece stop
+    // at its lexing error, so the lines from the error's on are taken too.
+    const auto old      = Lexer::get_file(piece.file).source;
+    size_t region_begin = line_begin(old, begin),
+           region_end   = line_end(old, end);
+    if (piece.err.type != LET::OK)
+    {
+      region_begin = std::min(region_begin, line_begin(old, piece.err.offset));
+      region_end   = old.size();
+    }
+    size_t first = 0, last = 0;
+    for (bool stable = false; !stable;)
+    {
+      stable = true;
+      first  = std::partition_point(toks.begin(), toks.end(),
+                                    [&](const Lexer::Token *token) {
+                                     return token_end(token) <= region_begin;
+                                   }) -
+              toks.begin();
+      last = std::partition_point(toks.begin() + first, toks.end(),
+                                  [&](const Lexer::Token *token) {
+                                    return token->offset < region_end;
+                                  }) -
+             toks.begin();
+      if (first < toks.size() && toks[first]->offset < region_begin)
+      {
+        region_begin = line_begin(old, toks[first]->offset);
+        stable       = false;
+      }
+      if (last > first && token_end(toks[last - 1]) > region_end)
+      {
+        region_end = line_end(old, token_end(toks[last - 1]));
+        stable     = false;
+      }
+    }
+
+    // Included files may use and define constants of this file defined before
+    // them, in ways only a rebuild can account for
+    const size_t use_piece = last_use ? by_file.at(last_use->file)->index : 0;
+    const bool before_use =
+        last_use && (k < use_piece ||
+                     (k == use_piece && region_begin <= last_use->offset));
+
+    const int64_t newlines =
+        std::count(text.begin(), text.end(), '\n') -
+        std::count(old.begin() + begin, old.begin() + end, '\n');
+    const int64_t quoted =
+        std::count(text.begin(), text.end(), '"') -
+        std::count(old.begin() + begin, old.begin() + end, '"');
+    Lexer::edit_file(piece.file, begin, end, text);
+    const size_t delta = text.size() - (end - begin);
+    piece.lines += newlines;
+    piece.quotes += quoted;
+    sizes.add(k, static_cast<int64_t>(delta));
+    lines.add(k, newlines);
+    quotes.add(k, quoted);
+
+    // A string literal may close on a later line, so lexing carries on from an
+    // open one to the end of the piece.  One left open there runs on to the
+    // next quote in the source: the pieces up to it are taken in and lexed on.
+    // No tokens are kept past an error.
+    std::vector<Lexer::Token *> fresh;
+    size_t lex_end = region_end + delta;
+    piece.err      = Lexer::tokenise_range(piece.file, region_begin, lex_end,
+                                           fresh, arena);
+    while (piece.err.type == LET::INVALID_STRING_LITERAL)
+    {
+      const size_t size = Lexer::get_file(piece.file).source.size();
+      const size_t next = quotes.find(quotes.prefix(k + 1));
+      if (lex_end < size)
+        lex_end = size;
+      else if (next < pieces.size())
+      {
+        for (size_t n = next - k; n > 0; --n)
+          merge(k, toks.size());
+        lex_end = Lexer::get_file(piece.file).source.size();
+      }
+      else
+        break;
+      last      = toks.size();
+      piece.err = Lexer::tokenise_range(piece.file, piece.err.offset, lex_end,
+                                        fresh, arena);
+    }
+    if (piece.err.type != LET::OK)
+      last = toks.size();
+    lexed += fresh.size();
+
+    // Splice the new tokens in, moving the rest of the piece along
+    std::vector<Lexer::Token *> gone{toks.begin() + first,
+                                     toks.begin() + last};
+    for (size_t i = last; i < toks.size(); ++i)
+      toks[i]->offset += delta;
+    toks.erase(toks.begin() + first, toks.begin() + last);
+    toks.insert(toks.begin() + first, fresh.begin(), fresh.end());
+    token_count += fresh.size() - gone.size();
+
+    std::vector<Lexer::Token *> removed;
+    const auto [added_begin, added_end] =
+        splice_items(k, first, gone, fresh.size(), removed);
+    auto &its = piece.items;
+
+    // Bring the definitions up to date with the items replaced
+    std::unordered_set<uint32_t> names;
+    std::unordered_set<Lexer::Token *> pending;
+    for (auto root : removed)
+    {
+      if (root->type == TT::PP_USE)
+      {
+        rebuild(source());
+        return;
+      }
+      const auto found = definition_names.find(root);
+      if (found == definition_names.end())
+        continue;
+      auto &defs = definitions[found->second];
+      defs.erase(std::find(defs.begin(), defs.end(), root));
+      names.insert(found->second);
+      definition_names.erase(found);
+    }
+
+    for (size_t i = added_begin; i < added_end; ++i)
+    {
+      const auto root = toks[its[i].begin];
+      uint32_t name   = 0;
+      if (its[i].type == Item::Type::USE)
+      {
+        rebuild(source());
+        return;
+      }
+      else if (defined_name(toks, its[i], name))
+      {
+        auto &defs = definitions[name];
+        defs.insert(std::upper_bound(defs.begin(), defs.end(), root,
+                                     [&](const Lexer::Token *a,
+                                         const Lexer::Token *b) {
+                                       return before(a, b);
+                                     }),
+                    root);
+        definition_names[root] = name;
+        names.insert(name);
+      }
+      else if (its[i].type == Item::Type::REFERENCE)
+        pending.insert(root);
+    }
+
+    if (before_use && !names.empty())
+    {
+      rebuild(source());
+      return;
+    }
+    for (const auto name : names)
+    {
+      bool changed = false;
+      if (!update_constant(name, changed))
+      {
+        rebuild(source());
+        return;
+      }
+      const auto found = dependents.find(name);
+      if (changed && found != dependents.end())
+        pending.insert(found->second.begin(), found->second.end());
+    }
+
+    // Macros which don't take effect are still checked by the preprocesser
+    for (size_t i = added_begin; i < added_end; ++i)
+    {
+      const auto root  = toks[its[i].begin];
+      const auto found = definition_names.find(root);
+      if (its[i].type == Item::Type::MACRO &&
+          (found == definition_names.end() ||
+           definitions[found->second].front() != root))
+        expand(piece, its[i]);
+    }
+
+    // Re-expand new references and those whose constants changed, taking the
+    // arguments their macros now do.  Stale dependents, whose items have since
+    // been replaced, are skipped.
+    for (auto root : pending)
+    {
+      Piece *holder = nullptr;
+      Item *item    = find_item(root, holder);
+      if (!item)
+        continue;
+      else if (item->type == Item::Type::USE)
+      {
+        rebuild(source());
+        return;
+      }
+      reshape(holder, item);
+      expand(*holder, *item);
+      if (!is_position_independent(*holder, *item))
+      {
+        rebuild(source());
+        return;
+      }
+    }
+
+    // Pieces may have been merged into others, so find the edit's afresh
+    const size_t n = std::min(sizes.find(at), pieces.size() - 1);
+    if (Lexer::get_file(pieces[n]->file).source.size() >
+        2 * INCREMENTAL_PIECE_SIZE)
+      split(n);
+  }
+
+  std::pair<size_t, size_t>
+  Document::splice_items(size_t k, size_t first,
+                         const std::vector<Lexer::Token *> &gone, size_t count,
+                         std::vector<Lexer::Token *> &removed)
+  {
+    auto &toks             = pieces[k]->tokens;
+    auto &its              = pieces[k]->items;
+    const size_t last      = first + gone.size();
+    const size_t fresh_end = first + count;
+    // Root token of an item, by its index before the splice
+    const auto old_root = [&](size_t i) {
+      if (i < first)
+        return toks[i];
+      else if (i < last)
+        return gone[i - first];
+      return toks[i - last + fresh_end];
+    };
+
+    // Re-itemise from the first item overlapping the new tokens, or a
+    // malformed one right before them as they depend on the token after them.
+    size_t lo = std::partition_point(
+                    its.begin(), its.end(),
+                    [&](const Item &item) { return item.end <= first; }) -
+                its.begin();
+    if (lo > 0 && its[lo - 1].err && its[lo - 1].end == first)
+      --lo;
+
+    // Stop once past the new tokens at a token which didn't fall inside an old
+    // item, as the items from there on are unchanged.
+    std::vector<Item> items;
+    size_t i = lo < its.size() ? std::min(first, its[lo].begin) : first;
+    size_t j = lo;
+    while (true)
+    {
+      if (i >= fresh_end)
+      {
+        const size_t old_i = i - fresh_end + last;
+        for (; j < its.size() && its[j].end <= old_i; ++j)
+          continue;
+        if (j == its.size() || its[j].begin >= old_i)
+          break;
+      }
+      if (is_directive(toks[i]->type))
+      {
+        bool truncated = false;
+        Item item      = itemise(toks, i, truncated);
+        // An item running off the end of the piece takes in the next, whose
+        // items are indexed as if the old tokens were still in place.  Those
+        // cut off by a lexing error are left as they are.
+        if (truncated && k + 1 < pieces.size() &&
+            pieces[k]->err.type == LET::OK)
+        {
+          merge(k, toks.size() - fresh_end + last);
+          continue;
+        }
+        items.push_back(item);
+        i = item.end;
+      }
+      else
+        ++i;
+    }
+
+    for (size_t n = lo; n < j; ++n)
+      removed.push_back(old_root(its[n].begin));
+    for (size_t n = j; n < its.size(); ++n)
+    {
+      its[n].begin = its[n].begin - last + fresh_end;
+      its[n].end   = its[n].end - last + fresh_end;
+    }
+    its.erase(its.begin() + lo, its.begin() + j);
+    its.insert(its.begin() + lo, items.begin(), items.end());
+    return {lo, lo + items.size()};
+  }
+
+  void Document::rebuild(std::string source)
+  {
+    arena.free();
+    const_map.clear();
+    file_map.clear();
+    expansions.clear();
+    definitions.clear();
+    definition_names.clear();
+    include_uses.clear();
+    dependents.clear();
+    last_use = nullptr;
+
+    // Lex the source whole in the first piece, to split up again after.  The
+    // lines after a lexing error are lexed alone in a piece of their own, as
+    // they would be once the error is fixed.
+    for (size_t k = 1; k < pieces.size(); ++k)
+    {
+      spare.push_back(pieces[k]->file);
+      by_file.erase(pieces[k]->file);
+    }
+    pieces.resize(1);
+    Lexer::edit_file(pieces[0]->file, 0,
+                     Lexer::get_file(pieces[0]->file).source.size(), source);
+    lexed       = 0;
+    token_count = 0;
+    for (size_t k = 0; k < pieces.size(); ++k)
+    {
+      Piece &piece = *pieces[k];
+      auto &toks   = piece.tokens;
+      auto &its    = piece.items;
+      toks.clear();
+      its.clear();
+      piece.err = Lexer::tokenise_buffer(piece.file, toks, arena);
+      token_count += toks.size();
+
+      const auto text  = Lexer::get_file(piece.file).source;
+      const size_t cut = piece.err.type == LET::OK
+                             ? text.size()
+                             : line_end(text, piece.err.offset);
+      if (cut < text.size())
+      {
+        const size_t size = text.size();
+        auto rest =
+            std::make_unique<Piece>(Piece{take_file(text.substr(cut)), 0, 0, 0,
+                                          {}, {}, {}});
+        by_file[rest->file] = rest.get();
+        pieces.push_back(std::move(rest));
+        Lexer::edit_file(piece.file, cut, size, "");
+      }
+      const auto kept = Lexer::get_file(piece.file).source;
+      piece.lines     = std::count(kept.begin(), kept.end(), '\n');
+      piece.quotes    = std::count(kept.begin(), kept.end(), '"');
+
+      for (size_t i = 0; i < toks.size();)
+      {
+        if (is_directive(toks[i]->type))
+        {
+          bool truncated = false;
+          its.push_back(itemise(toks, i, truncated));
+          i = its.back().end;
+        }
+        else
+          ++i;
+      }
+    }
+    reindex();
+
+    // Define and expand in order, as the preprocesser would
+    for (auto &piece : pieces)
+    {
+      const auto &toks = piece->tokens;
+      for (auto &item : piece->items)
+      {
+        const auto root = toks[item.begin];
+        uint32_t name   = 0;
+        if (defined_name(toks, item, name))
+        {
+          definitions[name].push_back(root);
+          definition_names[root] = name;
+        }
+
+        if (item.type == Item::Type::CONST)
+        {
+          const auto found = const_map.find(name);
+          if (!found || found->depth > 0)
+            const_map[name] = {root,
+                               arena.copy(toks.begin() + item.begin + 2,
+                                          toks.begin() + item.end - 1),
+                               0,
+                               {},
+                               0};
+        }
+        else if (item.type == Item::Type::MACRO)
+          expand(*piece, item);
+        else if (item.type == Item::Type::USE)
+        {
+          // Note the last %use to change each constant
+          last_use = root;
+          std::vector<Lexer::Token *> before(const_map.size());
+          for (uint32_t id = 0; id < const_map.size(); ++id)
+            before[id] =
+                const_map.find(id) ? const_map.find(id)->root : nullptr;
+          expand(*piece, item);
+          for (uint32_t id = 0; id < const_map.size(); ++id)
+          {
+            const auto found = const_map.find(id);
+            if (found && (id >= before.size() || before[id] != found->root))
+              include_uses[id] = root;
+          }
+        }
+        else if (item.type == Item::Type::REFERENCE)
+        {
+          // Calls to macros take the tokens after them as arguments, now the
+          // macros are known
+          bool truncated = false;
+          item.end       = itemise(toks, item.begin, truncated).end;
+          expand(*piece, item);
+        }
+      }
+    }
+
+    for (size_t k = pieces.size(); k > 0; --k)
+      split(k - 1);
+  }
+
+  void Document::split(size_t k)
+  {
+    Piece &piece     = *pieces[k];
+    const auto &toks = piece.tokens;
+    const auto &its  = piece.items;
+    const auto text  = Lexer::get_file(piece.file).source;
+
+    // Find the offsets and first tokens of the new pieces, about
+    // INCREMENTAL_PIECE_SIZE bytes apart at line starts which no token or item
+    // spans.  Malformed items may depend on the token after them, so none end
+    // a piece.  Nothing after the line of a lexing error is lexed, so the last
+    // piece starts at or before it.
+    const size_t limit = piece.err.type == LET::OK
+                             ? text.size()
+                             : line_begin(text, piece.err.offset);
+    std::vector<std::pair<size_t, size_t>> bounds;
+    size_t t = 0, n = 0;
+    for (size_t offset = INCREMENTAL_PIECE_SIZE; offset < text.size();)
+    {
+      const size_t at = line_end(text, offset - 1);
+      if (at >= text.size() || at > limit)
+        break;
+      for (; t < toks.size() && token_end(toks[t]) <= at; ++t)
+        continue;
+      for (; n < its.size() && its[n].end < t; ++n)
+        continue;
+      if (t < toks.size() && toks[t]->offset < at)
+        offset = token_end(toks[t]);
+      else if (n < its.size() && its[n].begin < t && its[n].end > t)
+        offset = token_end(toks[its[n].end - 1]);
+      else if (n < its.size() && its[n].end == t && its[n].err)
+        offset = at + 1;
+      else
+      {
+        bounds.push_back({at, t});
+        offset = at + INCREMENTAL_PIECE_SIZE;
+      }
+    }
+    if (bounds.empty())
+      return;
+
+    std::vector<std::unique_ptr<Piece>> split;
+    n = std::partition_point(
+            its.begin(), its.end(),
+            [&](const Item &item) { return item.begin < bounds[0].second; }) -
+        its.begin();
+    const size_t kept = n;
+    for (size_t b = 0; b < bounds.size(); ++b)
+    {
+      const auto [at, t_begin] = bounds[b];
+      const size_t to    = b + 1 < bounds.size() ? bounds[b + 1].first
+                                                 : text.size();
+      const size_t t_end = b + 1 < bounds.size() ? bounds[b + 1].second
+                                                 : toks.size();
+      const auto part = text.substr(at, to - at);
+      auto next       = std::make_unique<Piece>(
+          Piece{take_file(part),
+                0,
+                static_cast<size_t>(std::count(part.begin(), part.end(), '\n')),
+                static_cast<size_t>(std::count(part.begin(), part.end(), '"')),
+                {},
+                {toks.begin() + t_begin, toks.begin() + t_end},
+                {}});
+      for (auto token : next->tokens)
+      {
+        token->file   = next->file;
+        token->offset = token->offset - at;
+      }
+      if (b + 1 == bounds.size() && piece.err.type != LET::OK)
+        next->err = {piece.err.type, next->file, piece.err.offset - at};
+      for (; n < its.size() && its[n].begin < t_end; ++n)
+      {
+        next->items.push_back(its[n]);
+        next->items.back().begin -= t_begin;
+        next->items.back().end -= t_begin;
+      }
+      by_file[next->file] = next.get();
+      split.push_back(std::move(next));
+    }
+
+    piece.lines =
+        std::count(text.begin(), text.begin() + bounds[0].first, '\n');
+    piece.quotes =
+        std::count(text.begin(), text.begin() + bounds[0].first, '"');
+    piece.err = {};
+    piece.tokens.resize(bounds[0].second);
+    piece.items.resize(kept);
+    Lexer::edit_file(piece.file, bounds[0].first, text.size(), "");
+    pieces.insert(pieces.begin() + k + 1,
+                  std::make_move_iterator(split.begin()),
+                  std::make_move_iterator(split.end()));
+    reindex();
+  }
+
+  void Document::merge(size_t k, size_t item_base)
+  {
+    Piece &piece = *pieces[k], &next = *pieces[k + 1];
+    const size_t size = Lexer::get_file(piece.file).source.size();
+    Lexer::edit_file(piece.file, size, size,
+                     Lexer::get_file(next.file).source);
+    for (auto token : next.tokens)
+    {
+      token->file   = piece.file;
+      token->offset = token->offset + size;
+    }
+    piece.tokens.insert(piece.tokens.end(), next.tokens.begin(),
+                        next.tokens.end());
+    for (auto item : next.items)
+    {
+      item.begin += item_base;
+      item.end += item_base;
+      piece.items.push_back(item);
+    }
+    piece.lines += next.lines;
+    piece.quotes += next.quotes;
+    if (piece.err.type == LET::OK && next.err.type != LET::OK)
+      piece.err = {next.err.type, piece.file, next.err.offset + size};
+
+    spare.push_back(next.file);
+    by_file.erase(next.file);
+    pieces.erase(pieces.begin() + k + 1);
+    reindex();
+  }
+
+  void Document::reindex()
+  {
+    std::vector<size_t> bytes, newlines, quoted;
+    for (size_t k = 0; k < pieces.size(); ++k)
+    {
+      pieces[k]->index = k;
+      bytes.push_back(Lexer::get_file(pieces[k]->file).source.size());
+      newlines.push_back(pieces[k]->lines);
+      quoted.push_back(pieces[k]->quotes);
+    }
+    sizes.assign(bytes);
+    lines.assign(newlines);
+    quotes.assign(quoted);
+  }
+
+  uint16_t Document::take_file(std::string_view source)
+  {
+    if (spare.empty())
+    {
+      const uint16_t file = Lexer::add_file(name, Source{std::string{source}});
+      Lexer::set_first_line(file, [this, file]() { return first_line(file); });
+      return file;
+    }
+    const uint16_t file = spare.back();
+    spare.pop_back();
+    Lexer::edit_file(file, 0, Lexer::get_file(file).source.size(), source);
+    return file;
+  }
+
+  size_t Document::first_line(uint16_t file) const
+  {
+    const auto piece = by_file.find(file);
+    return piece == by_file.end() ? 0 : lines.prefix(piece->second->index);
+  }
+
+  bool Document::before(const Lexer::Token *a, const Lexer::Token *b) const
+  {
+    const size_t x = by_file.at(a->file)->index, y = by_file.at(b->file)->index;
+    return x != y ? x < y : a->offset < b->offset;
+  }
+
+  size_t Document::open_piece() const
+  {
+    // Only the last quote can be left open: any after it would close it
+    const size_t total = quotes.prefix(pieces.size());
+    if (total == 0)
+      return pieces.size();
+    const size_t k = quotes.find(total - 1);
+    return pieces[k]->err.type == LET::INVALID_STRING_LITERAL ? k
+                                                              : pieces.size();
+  }
+
+  size_t Document::parameters(uint32_t name)
+  {
+    const auto callee = const_map.find(name);
+    return callee && callee->root->type == TT::PP_MACRO ? callee->parameters
+                                                        : 0;
+  }
+
+  Item Document::itemise(const std::vector<Lexer::Token *> &toks, size_t i,
+                         bool &truncated)
+  {
+    const auto token   = toks[i];
+    const auto invalid = [&](ET type, size_t end, Lexer::Token *at) {
+      return Item{Item::Type::INVALID, i, end, Unit{nullptr, {0, 0}},
+                  arena.make<Preprocesser::Err>(type, at)};
+    };
+
+    if (token->type == TT::PP_CONST)
+    {
+      if (i == toks.size() - 1 || toks[i + 1]->type != TT::SYMBOL)
+      {
+        truncated = i == toks.size() - 1;
+        return invalid(ET::EXPECTED_SYMBOL_FOR_NAME, i + 1, token);
+      }
+      size_t end = 0;
+      for (end = i + 2; end < toks.size() && toks[end]->type != TT::PP_END;
+           ++end)
+        if (toks[end]->type == TT::PP_CONST ||
+            toks[end]->type == TT::PP_MACRO || toks[end]->type == TT::PP_USE)
+          return invalid(ET::DIRECTIVES_IN_CONST_BODY, end, toks[end]);
+      if (end == toks.size())
+      {
+        truncated = true;
+        return invalid(ET::EXPECTED_END, end, token);
+      }
+      else if (end - i == 2)
+        return invalid(ET::EMPTY_CONST, end + 1, token);
+      return Item{Item::Type::CONST, i, end + 1, Unit{nullptr, {0, 0}},
+                  nullptr};
+    }
+    else if (token->type == TT::PP_MACRO)
+    {
+      // The header and body are left to the preprocesser to check
+      size_t end = i + 1;
+      while (end < toks.size() && toks[end]->type != TT::PP_END)
+        ++end;
+      truncated = end == toks.size();
+      return Item{Item::Type::MACRO, i, std::min(end + 1, toks.size()),
+                  Unit{nullptr, {0, 0}}, nullptr};
+    }
+    else if (token->type == TT::PP_USE)
+    {
+      if (i == toks.size() - 1 || toks[i + 1]->type != TT::LITERAL_STRING)
+      {
+        truncated = i == toks.size() - 1;
+        return invalid(ET::EXPECTED_FILE_NAME_AS_STRING, i + 1, token);
+      }
+      return Item{Item::Type::USE, i, i + 2, Unit{nullptr, {0, 0}}, nullptr};
+    }
+    else if (token->type == TT::PP_REFERENCE)
+    {
+      // Calls to macros take the tokens after them as arguments, stopping
+      // short at a directive if malformed
+      const size_t count = parameters(token->symbol);
+      size_t end         = i + 1;
+      while (end - i - 1 < count && end < toks.size() &&
+             !is_directive(toks[end]->type))
+        ++end;
+      truncated = end - i - 1 < count && end == toks.size();
+      return Item{Item::Type::REFERENCE, i, end, Unit{nullptr, {0, 0}},
+                  nullptr};
+    }
+    return invalid(ET::NO_CONST_AROUND, i + 1, token);
+  }
+
+  void Document::reshape(Piece *&piece, Item *&item)
+  {
+    const auto root = piece->tokens[item->begin];
+    bool truncated  = false;
+    size_t end      = itemise(piece->tokens, item->begin, truncated).end;
+    // Arguments running off the end of the piece take in the next
+    while (truncated && piece->index + 1 < pieces.size() &&
+           piece->err.type == LET::OK)
+    {
+      merge(piece->index, piece->tokens.size());
+      item      = find_item(root, piece);
+      truncated = false;
+      end       = itemise(piece->tokens, item->begin, truncated).end;
+    }
+    item->end = end;
+  }
+
+  void Document::expand(Piece &piece, Item &item)
+  {
+    auto &toks      = piece.tokens;
+    const auto root = toks[item.begin];
+    // A malformed call is given the tokens it would take as arguments, for the
+    // preprocesser to report the one at fault
+    size_t end = item.end;
+    if (item.type == Item::Type::REFERENCE)
+      end = std::min(item.begin + 1 + parameters(root->symbol), toks.size());
+    std::vector<Unit> units;
+    item.err  = Preprocesser::preprocess(
+        {&toks[item.begin], end - item.begin}, units, expansions, arena,
+        const_map, file_map);
+    item.unit = item.err || units.empty() ? Unit{nullptr, {0, 0}} : units[0];
+    ++lexed;
+
+    // Depend on every constant the expansion could reach.  Follow the bodies
+    // of constants rather than the expansion, which stops at the first error.
+    // Changes before a %use rebuild the document, so it needs none.
+    if (item.type != Item::Type::REFERENCE)
+      return;
+    std::vector<Lexer::Token *> references{root};
+
+    std::unordered_set<uint32_t> seen;
+    while (!references.empty())
+    {
+      const auto name = references.back()->symbol;
+      references.pop_back();
+      if (!seen.insert(name).second)
+        continue;
+      dependents[name].insert(root);
+      if (const auto found = const_map.find(name))
+        for (auto token : found->body)
+          if (token->type == TT::PP_REFERENCE)
+            references.push_back(token);
+    }
+  }
+
+  bool Document::is_position_independent(const Piece &piece,
+                                         const Item &item)
+  {
+    // The expansion used the final definition of each constant, where the
+    // preprocesser would use the one in place at this item.  They're the same
+    // if every constant it can reach is defined before the item, or not at
+    // all.
+    const auto root = piece.tokens[item.begin];
+    std::vector<Lexer::Token *> references{root};
+    std::unordered_set<uint32_t> seen;
+    while (!references.empty())
+    {
+      const auto name = references.back()->symbol;
+      references.pop_back();
+      if (!seen.insert(name).second)
+        continue;
+
+      const auto defs = definitions.find(name);
+      const auto use  = include_uses.find(name);
+      if (defs != definitions.end() && !defs->second.empty())
+      {
+        if (!before(defs->second.front(), root))
+          return false;
+      }
+      else if (use != include_uses.end() && !before(use->second, root))
+        return false;
+
+      if (const auto found = const_map.find(name))
+        for (auto token : found->body)
+          if (token->type == TT::PP_REFERENCE)
+            references.push_back(token);
+    }
+    return true;
+  }
+
+  bool Document::update_constant(uint32_t name, bool &changed)
+  {
+    // Can't tell which definition from an include would take over
+    if (include_uses.find(name) != include_uses.end())
+      return false;
+
+    const auto found = const_map.find(name);
+    auto &defs       = definitions[name];
+    if (defs.empty())
+    {
+      definitions.erase(name);
+      changed = found;
+      if (changed)
+        const_map.erase(name);
+      return true;
+    }
+
+    Piece *piece = nullptr;
+    Item *item   = find_item(defs.front(), piece);
+    if (item->type == Item::Type::MACRO)
+    {
+      // The preprocesser checks the header of a macro as it defines it
+      const bool existed = found;
+      const auto old     = found ? *found : Preprocesser::Block{};
+      const_map.erase(name);
+      expand(*piece, *item);
+      const auto now = const_map.find(name);
+      changed        = existed != (now != nullptr) || (now && !same(old, *now));
+      return true;
+    }
+    Slice<Lexer::Token *> body{&piece->tokens[item->begin + 2],
+                               item->end - item->begin - 3};
+    changed = !found || found->root != defs.front() ||
+              !std::equal(body.begin(), body.end(), found->body.begin(),
+                          found->body.end());
+    if (changed)
+      const_map[name] = {defs.front(), arena.copy(body.begin(), body.end()), 0,
+                         {}, 0};
+    return true;
+  }
+
+  Item *Document::find_item(Lexer::Token *root, Piece *&piece)
+  {
+    const auto found = by_file.find(root->file);
+    if (found == by_file.end())
+      return nullptr;
+    piece            = found->second;
+    const auto &toks = piece->tokens;
+    auto &its        = piece->items;
+    const auto item  = std::partition_point(
+        its.begin(), its.end(), [&](const Item &item) {
+          return toks[item.begin]->offset < root->offset;
+        });
+    if (item == its.end() || toks[item->begin] != root)
+      return nullptr;
+    return &*item;
+  }
+
+  std::string Document::source() const
+  {
+    std::string source;
+    for (const auto &piece : pieces)
+      source += Lexer::get_file(piece->file).source;
+    return source;
+  }
+
+  // Tokens, items and units stop at the first lexing error, as lexing the
+  // whole source would
+
+  std::vector<Lexer::Token *> Document::tokens() const
+  {
+    std::vector<Lexer::Token *> tokens;
+    for (const auto &piece : pieces)
+    {
+      tokens.insert(tokens.end(), piece->tokens.begin(), piece->tokens.end());
+      if (piece->err.type != LET::OK)
+        break;
+    }
+    return tokens;
+  }
+
+  std::vector<Item> Document::items() const
+  {
+    std::vector<Item> items;
+    size_t base = 0;
+    for (const auto &piece : pieces)
+    {
+      for (auto item : piece->items)
+      {
+        item.begin += base;
+        item.end += base;
+        items.push_back(item);
+      }
+      base += piece->tokens.size();
+      if (piece->err.type != LET::OK)
+        break;
+    }
+    return items;
+  }
+
+  std::vector<Unit> Document::units() const
+  {
+    std::vector<Unit> units;
+    for (const auto &piece : pieces)
+    {
+      const auto &toks = piece->tokens;
+      size_t i         = 0;
+      for (const auto &item : piece->items)
+      {
+        for (; i < item.begin; ++i)
+          units.push_back(Unit{toks[i], {0, 0}});
+        if (item.unit.root)
+          units.push_back(item.unit);
+        i = item.end;
+      }
+      for (; i < toks.size(); ++i)
+        units.push_back(Unit{toks[i], {0, 0}});
+      if (piece->err.type != LET::OK)
+        break;
+    }
+    return units;
+  }
+
+  const Preprocesser::Tree &Document::tree() const
+  {
+    return expansions;
+  }
+
+  const Lexer::Err &Document::lexer_error() const
+  {
+    static const Lexer::Err none;
+    for (const auto &piece : pieces)
+      if (piece->err.type != LET::OK)
+        return piece->err;
+    return none;
+  }
+
+  Preprocesser::Err *Document::error() const
+  {
+    if (lexer_error().type != LET::OK)
+      return nullptr;
+    for (const auto &piece : pieces)
+      for (const auto &item : piece->items)
+        if (item.err)
+          return item.err;
+    return nullptr;
+  }
+} // namespace Incremental
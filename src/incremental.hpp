@@ -0,0 +1,195 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Incremental lexing and preprocessing of an edited source
+ */
+
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <src/arena.hpp>
+#include <src/lexer.hpp>
+#include <src/preprocesser.hpp>
+
+// Work done by edits, beyond twice the live tokens, before a document is
+// rebuilt to reclaim its arena
+#define INCREMENTAL_GARBAGE_LIMIT (64 * 1024)
+// Bytes of source a document holds in each piece, of which an edit copies and
+// re-lexes those it falls in
+#define INCREMENTAL_PIECE_SIZE (4 * 1024)
+
+namespace Incremental
+{
+  // A run of top level tokens which the preprocesser treats as one: a constant
+  // or macro definition, a %use, a reference (with its arguments if it calls a
+  // macro) or a malformed directive.  Tokens outside of items are plain and
+  // become a unit each.
+  struct Item
+  {
+    enum class Type
+    {
+      CONST,
+      MACRO,
+      USE,
+      REFERENCE,
+      INVALID,
+    } type;
+    // Token indices [begin, end), into the piece of a document holding the
+    // item or, from Document::items, into Document::tokens
+    size_t begin, end;
+    // No root if the item expands to nothing (constants, empty or repeated
+    // %use) or failed to expand.
+    Preprocesser::Unit unit;
+    Preprocesser::Err *err;
+  };
+
+  // Counts of a sequence, kept as a Fenwick tree so that changing one or
+  // summing those before one takes time logarithmic in their number
+  struct Sums
+  {
+    void assign(const std::vector<size_t> &counts);
+    void add(size_t i, int64_t delta);
+    // Sum of counts [0, i)
+    size_t prefix(size_t i) const;
+    // Last i such that prefix(i) is at most `sum`
+    size_t find(size_t sum) const;
+
+  private:
+    std::vector<size_t> tree;
+  };
+
+  // A source file kept lexed and preprocessed across edits, for use by editor
+  // integrations.  An edit re-lexes only the lines it touches, splices the new
+  // tokens in and re-expands only the items whose inputs changed: new items
+  // and any reference depending on a constant or macro which was (re)defined.
+  // The results are always those of lexing and preprocessing the whole file;
+  // where that can't be guaranteed cheaply (an edit to a %use, forward
+  // references) the document is rebuilt instead.
+  //
+  // The source is split into pieces of about INCREMENTAL_PIECE_SIZE bytes,
+  // each added to the lexer as a file of its own, so tokens are placed within
+  // their piece and an edit moves none outside of the one it falls in.
+  // Positions of tokens still count lines from the start of the document.
+  //
+  // A piece which fails to lex holds the error and the tokens before it, and
+  // is re-lexed from the line of the error on by each edit to it until fixed;
+  // the other pieces are left alone.  A string literal left open runs on to
+  // the next quote in the source, so its piece takes in those up to it.
+  struct Document
+  {
+    Document(std::string name, Source source);
+    ~Document();
+    Document(const Document &)            = delete;
+    Document &operator=(const Document &) = delete;
+
+    // Replace source[begin, end) with `text`.
+    void edit(size_t begin, size_t end, std::string_view text);
+
+    // The source and its tokens and items as a whole, gathered from the
+    // pieces on each call
+    std::string source() const;
+    std::vector<Lexer::Token *> tokens() const;
+    std::vector<Item> items() const;
+    // Top level units as produced by Preprocesser::preprocess, and the tree
+    // holding their expansions
+    std::vector<Preprocesser::Unit> units() const;
+    const Preprocesser::Tree &tree() const;
+
+    // First error in the source, if any.  Lexing errors stop preprocessing.
+    const Lexer::Err &lexer_error() const;
+    Preprocesser::Err *error() const;
+
+  private:
+    // A run of whole lines of the source.  No token or item spans two pieces,
+    // and no item at the end of one depends on the tokens after it, so each
+    // piece may be lexed and itemised alone.
+    struct Piece
+    {
+      uint16_t file;
+      // Place among the pieces
+      size_t index;
+      // Newlines and quotes in the source of the piece
+      size_t lines, quotes;
+      // Tokens stop at the error, if any
+      Lexer::Err err;
+      std::vector<Lexer::Token *> tokens;
+      std::vector<Item> items;
+    };
+
+    std::string name;
+    std::vector<std::unique_ptr<Piece>> pieces;
+    std::unordered_map<uint16_t, Piece *> by_file;
+    // Bytes, lines and quotes of each piece
+    Sums sizes, lines, quotes;
+    // Files of pieces merged into others, to hold those split off later
+    std::vector<uint16_t> spare;
+    Arena arena;
+    size_t token_count;
+    Preprocesser::Const_Map const_map;
+    Preprocesser::Map file_map;
+    Preprocesser::Tree expansions;
+    // Top level definitions of each constant by symbol ID, in source order, and
+    // the constant defined by each
+    std::unordered_map<uint32_t, std::vector<Lexer::Token *>> definitions;
+    std::unordered_map<Lexer::Token *, uint32_t> definition_names;
+    // Last %use to change the definition of each constant
+    std::unordered_map<uint32_t, Lexer::Token *> include_uses;
+    // Root tokens of items whose expansion refers to each constant
+    std::unordered_map<uint32_t, std::unordered_set<Lexer::Token *>> dependents;
+    // Tokens lexed and items expanded since the last rebuild, to bound the
+    // garbage left in the arena
+    size_t lexed;
+    // Root of the last %use
+    Lexer::Token *last_use;
+
+    void rebuild(std::string source);
+    // Split a piece into pieces of about INCREMENTAL_PIECE_SIZE bytes, or
+    // append the next piece to one, offsetting the next's items by `item_base`
+    void split(size_t piece);
+    void merge(size_t piece, size_t item_base);
+    void reindex();
+    uint16_t take_file(std::string_view source);
+    // Lines before the piece held by `file`
+    size_t first_line(uint16_t file) const;
+    // Whether token `a` comes before `b` in the source
+    bool before(const Lexer::Token *a, const Lexer::Token *b) const;
+    // Piece holding a string literal left open, or the number of pieces
+    size_t open_piece() const;
+    // Arguments taken by a reference to `name`
+    size_t parameters(uint32_t name);
+    // Item rooted at tokens[i], setting `truncated` if it ran out of tokens
+    // before it could end.  A call to a macro takes its arguments as defined
+    // in the constant map.
+    Item itemise(const std::vector<Lexer::Token *> &tokens, size_t i,
+                 bool &truncated);
+    // Bring the arguments taken by a reference up to date with its macro
+    void reshape(Piece *&, Item *&);
+    std::pair<size_t, size_t>
+    splice_items(size_t piece, size_t first,
+                 const std::vector<Lexer::Token *> &gone, size_t count,
+                 std::vector<Lexer::Token *> &removed);
+    void expand(Piece &, Item &);
+    bool is_position_independent(const Piece &, const Item &);
+    bool update_constant(uint32_t name, bool &changed);
+    Item *find_item(Lexer::Token *root, Piece *&piece);
+  };
+} // namespace Incremental
+
+#endif
@@ -20,8 +20,20 @@ extern "C"
 }
 
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
-#include <unordered_map>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <src/lexer.hpp>
 
@@ -35,32 +47,454 @@ namespace Lexer
                      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUV"
                      "WXYZ0123456789-_.:%#$",
                  VALID_DIGIT = "0123456789",
-                 VALID_HEX   = "0123456789abcdefABCDEF";
+                 VALID_HEX   = "0123456789abcdefABCDEF",
+                 // As per isspace in the C locale
+                 VALID_SPACE = " \t\n\v\f\r";
+
+  // Character classes, as bit flags in CHAR_CLASSES
+  enum Char_Class : uint8_t
+  {
+    CLASS_SYMBOL = 1 << 0,
+    CLASS_DIGIT  = 1 << 1,
+    CLASS_HEX    = 1 << 2,
+    CLASS_SPACE  = 1 << 3,
+    // Whitespace skipped between tokens, which includes the null byte
+    CLASS_BLANK  = 1 << 4,
+  };
+
+  struct Class_Table
+  {
+    uint8_t classes[256];
+
+    constexpr void add(const char *s, uint8_t cls)
+    {
+      for (; *s; ++s)
+        classes[static_cast<uint8_t>(*s)] |= cls;
+    }
+
+    constexpr Class_Table() : classes{}
+    {
+      add(VALID_SYMBOL, CLASS_SYMBOL);
+      add(VALID_DIGIT, CLASS_DIGIT);
+      add(VALID_HEX, CLASS_HEX);
+      add(VALID_SPACE, CLASS_SPACE | CLASS_BLANK);
+      classes[0] |= CLASS_BLANK;
+    }
+  };
+
+  constexpr Class_Table CHAR_CLASSES{};
+
+  constexpr bool is_class(char c, uint8_t cls)
+  {
+    return CHAR_CLASSES.classes[static_cast<uint8_t>(c)] & cls;
+  }
+
+  // Vector of bytes for the scanning kernels below, using the widest
+  // instruction set the compiler has been allowed to target.
+#if defined(__AVX2__)
+#define LEXER_SIMD 1
+  struct Bytes
+  {
+    static constexpr size_t WIDTH = 32;
+    __m256i v;
+
+    static Bytes load(const char *ptr)
+    {
+      return {_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr))};
+    }
+
+    Bytes eq(char c) const
+    {
+      return {_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))};
+    }
+
+    // Unsigned lo <= v <= hi
+    Bytes in_range(char lo, char hi) const
+    {
+      __m256i ge =
+          _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(lo)), v);
+      __m256i le =
+          _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(hi)), v);
+      return {_mm256_and_si256(ge, le)};
+    }
+
+    Bytes fold_case() const
+    {
+      return {_mm256_or_si256(v, _mm256_set1_epi8(0x20))};
+    }
+
+    Bytes operator|(Bytes other) const
+    {
+      return {_mm256_or_si256(v, other.v)};
+    }
+
+    uint32_t mask() const
+    {
+      return static_cast<uint32_t>(_mm256_movemask_epi8(v));
+    }
+  };
+#elif defined(__SSE2__)
+#define LEXER_SIMD 1
+  struct Bytes
+  {
+    static constexpr size_t WIDTH = 16;
+    __m128i v;
+
+    static Bytes load(const char *ptr)
+    {
+      return {_mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr))};
+    }
+
+    Bytes eq(char c) const
+    {
+      return {_mm_cmpeq_epi8(v, _mm_set1_epi8(c))};
+    }
+
+    // Unsigned lo <= v <= hi
+    Bytes in_range(char lo, char hi) const
+    {
+      __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(lo)), v);
+      __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(hi)), v);
+      return {_mm_and_si128(ge, le)};
+    }
+
+    Bytes fold_case() const
+    {
+      return {_mm_or_si128(v, _mm_set1_epi8(0x20))};
+    }
+
+    Bytes operator|(Bytes other) const
+    {
+      return {_mm_or_si128(v, other.v)};
+    }
+
+    uint32_t mask() const
+    {
+      return static_cast<uint32_t>(_mm_movemask_epi8(v));
+    }
+  };
+#else
+#define LEXER_SIMD 0
+#endif
+
+  // Predicates for the scanning kernels.  Each has a scalar form using
+  // CHAR_CLASSES and a vector form which must agree with it.
+  struct Is_Blank
+  {
+    static bool test(char c)
+    {
+      return is_class(c, CLASS_BLANK);
+    }
+#if LEXER_SIMD
+    static Bytes test(Bytes b)
+    {
+      return b.eq(' ') | b.in_range('\t', '\r') | b.eq('\0');
+    }
+#endif
+  };
+
+  struct Is_Not_Newline
+  {
+    static bool test(char c)
+    {
+      return c != '\n';
+    }
+#if LEXER_SIMD
+    // Inverted by the kernel, see scan
+    static constexpr bool INVERT = true;
+    static Bytes test(Bytes b)
+    {
+      return b.eq('\n');
+    }
+#endif
+  };
+
+  struct Is_Symbol
+  {
+    static bool test(char c)
+    {
+      return is_class(c, CLASS_SYMBOL);
+    }
+#if LEXER_SIMD
+    static Bytes test(Bytes b)
+    {
+      return b.fold_case().in_range('a', 'z') | b.in_range('0', '9') |
+             b.eq('-') | b.eq('_') | b.eq('.') | b.eq(':') | b.eq('%') |
+             b.eq('#') | b.eq('$');
+    }
+#endif
+  };
+
+  struct Is_Digit
+  {
+    static bool test(char c)
+    {
+      return is_class(c, CLASS_DIGIT);
+    }
+#if LEXER_SIMD
+    static Bytes test(Bytes b)
+    {
+      return b.in_range('0', '9');
+    }
+#endif
+  };
 
-  bool is_char_in_s(char c, const char *s)
+  struct Is_Hex
   {
-    return string_view(s).find(c) != string::npos;
+    static bool test(char c)
+    {
+      return is_class(c, CLASS_HEX);
+    }
+#if LEXER_SIMD
+    static Bytes test(Bytes b)
+    {
+      return b.in_range('0', '9') | b.fold_case().in_range('a', 'f');
+    }
+#endif
+  };
+
+  template <typename T, typename = void>
+  struct is_inverted : std::false_type
+  {
+  };
+
+  template <typename T>
+  struct is_inverted<T, std::void_t<decltype(T::INVERT)>> : std::true_type
+  {
+  };
+
+  // Index of the first character at or after `i` in `src` which doesn't
+  // satisfy the predicate, or src.size() if there is none.  Full vectors are
+  // checked at a time, leaving the tail to the scalar form.
+  template <typename Pred>
+  size_t scan(string_view src, size_t i = 0)
+  {
+#if LEXER_SIMD
+    constexpr uint32_t all = Bytes::WIDTH == 32 ? 0xFFFFFFFF : 0xFFFF;
+    for (; i + Bytes::WIDTH <= src.size(); i += Bytes::WIDTH)
+    {
+      uint32_t mask = Pred::test(Bytes::load(src.data() + i)).mask();
+      if constexpr (!is_inverted<Pred>::value)
+        mask ^= all;
+      if (mask)
+        return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < src.size() && Pred::test(src[i]); ++i)
+      continue;
+    return i;
+  }
+
+  constexpr char to_upper(char c)
+  {
+    return (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+  }
+
+  // Case insensitive comparison of `src` against an upper case string `match`.
+  constexpr bool equal_nocase(string_view src, string_view match)
+  {
+    if (src.size() != match.size())
+      return false;
+    for (size_t i = 0; i < src.size(); ++i)
+      if (to_upper(src[i]) != match[i])
+        return false;
+    return true;
+  }
+
+  string to_upper(string_view src)
+  {
+    string str{src};
+    std::transform(str.begin(), str.end(), str.begin(), ::toupper);
+    return str;
+  }
+
+  // Mnemonics recognised by tokenise_symbol.  Mnemonics with no suffix must
+  // match the whole symbol.  The others are a root (including the trailing
+  // '.') which must be followed by a type, parsed as per the suffix kind.
+  enum class Suffix
+  {
+    NONE,
+    UNSIGNED,
+    SIGNED,
+  };
+
+  struct Mnemonic
+  {
+    string_view name;
+    Token::Type type;
+    Suffix suffix;
+  };
+
+  constexpr Mnemonic MNEMONICS[] = {
+      {"%CONST", Token::Type::PP_CONST, Suffix::NONE},
+      {"%MACRO", Token::Type::PP_MACRO, Suffix::NONE},
+      {"%USE", Token::Type::PP_USE, Suffix::NONE},
+      {"%END", Token::Type::PP_END, Suffix::NONE},
+      {"GLOBAL", Token::Type::GLOBAL, Suffix::NONE},
+      {"NOINLINE", Token::Type::NOINLINE, Suffix::NONE},
+      {"NOOP", Token::Type::NOOP, Suffix::NONE},
+      {"HALT", Token::Type::HALT, Suffix::NONE},
+      {"PUSH.", Token::Type::PUSH, Suffix::UNSIGNED},
+      {"POP.", Token::Type::POP, Suffix::UNSIGNED},
+      {"PUSH.REG.", Token::Type::PUSH_REG, Suffix::UNSIGNED},
+      {"MOV.", Token::Type::MOV, Suffix::UNSIGNED},
+      {"DUP.", Token::Type::DUP, Suffix::UNSIGNED},
+      {"MALLOC.", Token::Type::MALLOC, Suffix::UNSIGNED},
+      {"MSET.", Token::Type::MSET, Suffix::UNSIGNED},
+      {"MGET.", Token::Type::MGET, Suffix::UNSIGNED},
+      {"MDELETE", Token::Type::MDELETE, Suffix::NONE},
+      {"MSIZE", Token::Type::MSIZE, Suffix::NONE},
+      {"NOT.", Token::Type::NOT, Suffix::UNSIGNED},
+      {"OR.", Token::Type::OR, Suffix::UNSIGNED},
+      {"AND.", Token::Type::AND, Suffix::UNSIGNED},
+      {"XOR.", Token::Type::XOR, Suffix::UNSIGNED},
+      {"EQ.", Token::Type::EQ, Suffix::UNSIGNED},
+      {"LT.", Token::Type::LT, Suffix::SIGNED},
+      {"LTE.", Token::Type::LTE, Suffix::SIGNED},
+      {"GT.", Token::Type::GT, Suffix::SIGNED},
+      {"GTE.", Token::Type::GTE, Suffix::SIGNED},
+      {"PLUS.", Token::Type::PLUS, Suffix::SIGNED},
+      {"SUB.", Token::Type::SUB, Suffix::SIGNED},
+      {"MULT.", Token::Type::MULT, Suffix::SIGNED},
+      {"PRINT.", Token::Type::PRINT, Suffix::SIGNED},
+      {"JUMP.ABS", Token::Type::JUMP_ABS, Suffix::NONE},
+      {"JUMP.STACK", Token::Type::JUMP_STACK, Suffix::NONE},
+      {"JUMP.IF.", Token::Type::JUMP_IF, Suffix::UNSIGNED},
+      {"CALL", Token::Type::CALL, Suffix::NONE},
+      {"RET", Token::Type::RET, Suffix::NONE},
+  };
+
+  constexpr size_t NUMBER_OF_MNEMONICS =
+      sizeof(MNEMONICS) / sizeof(MNEMONICS[0]);
+
+  constexpr size_t mnemonic_max_size()
+  {
+    size_t max = 0;
+    for (const auto &m : MNEMONICS)
+      max = m.name.size() > max ? m.name.size() : max;
+    return max;
+  }
+
+  constexpr size_t MNEMONIC_MAX_SIZE = mnemonic_max_size();
+
+  // Every instruction token must be produced by exactly one mnemonic, so
+  // adding an instruction to Token::Type without a mnemonic is caught here.
+  constexpr bool mnemonics_cover_instructions()
+  {
+    for (auto i = static_cast<int>(Token::Type::NOOP);
+         i <= static_cast<int>(Token::Type::RET); ++i)
+    {
+      size_t count = 0;
+      for (const auto &m : MNEMONICS)
+        if (static_cast<int>(m.type) == i)
+          ++count;
+      if (count != 1)
+        return false;
+    }
+    return true;
+  }
+
+  static_assert(mnemonics_cover_instructions(),
+                "ERROR: Lexer mnemonic table is out of date");
+
+  // Perfect hash over MNEMONICS: a seeded FNV-1a over the upper cased
+  // characters, where the seed is searched for at compile time such that no
+  // two mnemonics share a slot.  A lookup is then one hash and one compare.
+  constexpr size_t MNEMONIC_SLOTS = 128;
+
+  constexpr uint32_t mnemonic_hash(string_view sym, uint32_t seed)
+  {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : sym)
+    {
+      hash ^= static_cast<uint8_t>(to_upper(c));
+      hash *= 16777619u;
+    }
+    return (hash ^ (hash >> 15)) % MNEMONIC_SLOTS;
+  }
+
+  constexpr bool mnemonic_seed_is_perfect(uint32_t seed)
+  {
+    bool used[MNEMONIC_SLOTS] = {};
+    for (const auto &m : MNEMONICS)
+    {
+      const auto slot = mnemonic_hash(m.name, seed);
+      if (used[slot])
+        return false;
+      used[slot] = true;
+    }
+    return true;
+  }
+
+  constexpr uint32_t mnemonic_find_seed()
+  {
+    uint32_t seed = 0;
+    while (!mnemonic_seed_is_perfect(seed))
+      ++seed;
+    return seed;
   }
 
-  bool initial_match(string_view src, string_view match)
+  constexpr uint32_t MNEMONIC_SEED = mnemonic_find_seed();
+
+  struct Mnemonic_Table
+  {
+    uint8_t slots[MNEMONIC_SLOTS];
+
+    constexpr Mnemonic_Table() : slots{}
+    {
+      for (auto &slot : slots)
+        slot = NUMBER_OF_MNEMONICS;
+      for (size_t i = 0; i < NUMBER_OF_MNEMONICS; ++i)
+        slots[mnemonic_hash(MNEMONICS[i].name, MNEMONIC_SEED)] = i;
+    }
+  };
+
+  static_assert(NUMBER_OF_MNEMONICS < 256);
+  constexpr Mnemonic_Table MNEMONIC_TABLE{};
+
+  // Find the mnemonic that is exactly `sym`, ignoring case.
+  const Mnemonic *find_mnemonic(string_view sym)
   {
-    return (src.size() > match.size() && src.substr(0, match.size()) == match);
+    if (sym.size() == 0 || sym.size() > MNEMONIC_MAX_SIZE)
+      return nullptr;
+    const auto index = MNEMONIC_TABLE.slots[mnemonic_hash(sym, MNEMONIC_SEED)];
+    if (index == NUMBER_OF_MNEMONICS ||
+        !equal_nocase(sym, MNEMONICS[index].name))
+      return nullptr;
+    return MNEMONICS + index;
+  }
+
+  // Find the longest typed mnemonic which is a strict prefix of `sym`.  Typed
+  // roots always end in '.', so only prefixes up to a '.' are considered.
+  const Mnemonic *find_typed_mnemonic(string_view sym)
+  {
+    const Mnemonic *found = nullptr;
+    const auto bound      = std::min(sym.size() - 1, MNEMONIC_MAX_SIZE);
+    for (size_t i = 0; i < bound; ++i)
+    {
+      if (sym[i] != '.')
+        continue;
+      const auto mnemonic = find_mnemonic(sym.substr(0, i + 1));
+      if (mnemonic && mnemonic->suffix != Suffix::NONE)
+        found = mnemonic;
+    }
+    return found;
   }
 
   Err::Type tokenise_unsigned_type(const string_view &symbol,
                                    Token::OperandType &type)
   {
-    if (symbol == "BYTE")
+    if (equal_nocase(symbol, "BYTE"))
     {
       type = Token::OperandType::BYTE;
       return Err::Type::OK;
     }
-    else if (symbol == "HWORD")
+    else if (equal_nocase(symbol, "HWORD"))
     {
       type = Token::OperandType::HWORD;
       return Err::Type::OK;
     }
-    else if (symbol == "WORD")
+    else if (equal_nocase(symbol, "WORD"))
     {
       type = Token::OperandType::WORD;
       return Err::Type::OK;
@@ -71,32 +505,32 @@ namespace Lexer
   Err::Type tokenise_signed_type(const string_view &symbol,
                                  Token::OperandType &type)
   {
-    if (symbol == "BYTE")
+    if (equal_nocase(symbol, "BYTE"))
     {
       type = Token::OperandType::BYTE;
       return Err::Type::OK;
     }
-    else if (symbol == "CHAR")
+    else if (equal_nocase(symbol, "CHAR"))
     {
       type = Token::OperandType::CHAR;
       return Err::Type::OK;
     }
-    else if (symbol == "HWORD")
+    else if (equal_nocase(symbol, "HWORD"))
     {
       type = Token::OperandType::HWORD;
       return Err::Type::OK;
     }
-    else if (symbol == "INT")
+    else if (equal_nocase(symbol, "INT"))
     {
       type = Token::OperandType::INT;
       return Err::Type::OK;
     }
-    else if (symbol == "WORD")
+    else if (equal_nocase(symbol, "WORD"))
     {
       type = Token::OperandType::WORD;
       return Err::Type::OK;
     }
-    else if (symbol == "LONG")
+    else if (equal_nocase(symbol, "LONG"))
     {
       type = Token::OperandType::LONG;
       return Err::Type::OK;
@@ -104,324 +538,515 @@ namespace Lexer
     return Err::Type::EXPECTED_TYPE_SUFFIX;
   }
 
-  Err tokenise_symbol(string_view &source_name, string_view &source,
-                      size_t &column, size_t line, Token &token)
-  {
-    auto end = source.find_first_not_of(VALID_SYMBOL);
-    if (end == string::npos)
-      end = source.size() - 1;
-    string sym{source.substr(0, end)};
-    source.remove_prefix(end);
-    std::transform(sym.begin(), sym.end(), sym.begin(), ::toupper);
-
-    // Tokens that are fixed i.e. have no variations.  This is because they have
-    // no type.
-    std::unordered_map<std::string, Token::Type> fixed_map = {
-        {"%CONST", Token::Type::PP_CONST}, {"%USE", Token::Type::PP_USE},
-        {"%END", Token::Type::PP_END},     {"NOOP", Token::Type::NOOP},
-        {"HALT", Token::Type::HALT},       {"MDELETE", Token::Type::MDELETE},
-        {"MSIZE", Token::Type::MSIZE},     {"JUMP.ABS", Token::Type::JUMP_ABS},
-        {"CALL", Token::Type::CALL},       {"RET", Token::Type::RET},
-        {"GLOBAL", Token::Type::GLOBAL},
-    };
-
-    // Tokens that have different types, encoded by the string following some
-    // root string.  The type is found by the type_tokeniser function.
-    struct InitialMatch
-    {
-      std::string match;
-      Token::Type type;
-      Err::Type (*type_tokeniser)(const std::string_view &,
-                                  Token::OperandType &);
-    } typed_map[] = {
-        {"PUSH.REG.", Token::Type::PUSH_REG, tokenise_unsigned_type},
-        {"PUSH.", Token::Type::PUSH, tokenise_unsigned_type},
-        {"POP.", Token::Type::POP, tokenise_unsigned_type},
-        {"MOV.", Token::Type::MOV, tokenise_unsigned_type},
-        {"DUP.", Token::Type::DUP, tokenise_unsigned_type},
-        {"MALLOC.", Token::Type::MALLOC, tokenise_unsigned_type},
-        {"MSET.", Token::Type::MSET, tokenise_unsigned_type},
-        {"MGET.", Token::Type::MGET, tokenise_unsigned_type},
-        {"NOT.", Token::Type::NOT, tokenise_unsigned_type},
-        {"OR.", Token::Type::OR, tokenise_unsigned_type},
-        {"AND.", Token::Type::AND, tokenise_unsigned_type},
-        {"XOR.", Token::Type::XOR, tokenise_unsigned_type},
-        {"EQ.", Token::Type::EQ, tokenise_unsigned_type},
-        {"LTE.", Token::Type::LTE, tokenise_signed_type},
-        {"LT.", Token::Type::LT, tokenise_signed_type},
-        {"GTE.", Token::Type::GTE, tokenise_signed_type},
-        {"GT.", Token::Type::GT, tokenise_signed_type},
-        {"SUB.", Token::Type::SUB, tokenise_signed_type},
-        {"PLUS.", Token::Type::PLUS, tokenise_signed_type},
-        {"MULT.", Token::Type::MULT, tokenise_signed_type},
-        {"PRINT.", Token::Type::PRINT, tokenise_signed_type},
-        {"JUMP.IF.", Token::Type::JUMP_IF, tokenise_unsigned_type},
-    };
-
-    bool found = false;
+  Err tokenise_symbol(uint16_t file, size_t offset, string_view &source,
+                      Token &token)
+  {
+    string_view sym = source.substr(0, scan<Is_Symbol>(source));
+    source.remove_prefix(sym.size());
 
-    if (fixed_map.find(sym) != fixed_map.end())
+    const Mnemonic *mnemonic = find_mnemonic(sym);
+    if (mnemonic && mnemonic->suffix == Suffix::NONE)
     {
-      token.type         = fixed_map[sym];
+      token.type         = mnemonic->type;
       token.operand_type = Token::OperandType::NIL;
-      found              = true;
     }
     else if (sym.size() > 1 && sym[0] == '$')
-    {
-      token = Token{Token::Type::PP_REFERENCE, sym.substr(1)};
-      found = true;
-    }
+      token.type = Token::Type::PP_REFERENCE;
     // Can't be a preprocesser directive as we've classified them all.
     else if (sym[0] == '%')
-      return Err(Err::Type::INVALID_PREPROCESSOR_DIRECTIVE, column, line,
-                 source_name);
-
+      return Err(Err::Type::INVALID_PREPROCESSOR_DIRECTIVE, file, offset);
     // NOTE: We only check the typed operators (i.e. initial match tokens) IF we
     // cannot find it by previous methods.
-    for (size_t i = 0; !found && i < sizeof(typed_map) / sizeof(typed_map[0]);
-         ++i)
+    else if ((mnemonic = find_typed_mnemonic(sym)))
     {
-      if (initial_match(sym, typed_map[i].match))
-      {
-        token.type = typed_map[i].type;
-
-        const auto offset = typed_map[i].match.size();
-        Err::Type type =
-            typed_map[i].type_tokeniser(sym.substr(offset), token.operand_type);
-        if (type != Err::Type::OK)
-          return Err{type, column + offset, line, source_name};
-        found = true;
-      }
-    }
-
-    // After running all maps and immediate checks, if the token still hasn't
-    // been found then just assume it's a symbol.
-    if (!found)
-    {
-      token.type    = Token::Type::SYMBOL;
-      token.content = sym;
+      token.type       = mnemonic->type;
+      const auto start = mnemonic->name.size();
+      Err::Type type =
+          mnemonic->suffix == Suffix::SIGNED
+              ? tokenise_signed_type(sym.substr(start), token.operand_type)
+              : tokenise_unsigned_type(sym.substr(start), token.operand_type);
+      if (type != Err::Type::OK)
+        return Err{type, file, offset + start};
     }
+    // After running all checks, if the token still hasn't been found then just
+    // assume it's a symbol.
+    else
+      token.type = Token::Type::SYMBOL;
 
-    token.column = column;
-    column += sym.size() - 1;
     return Err();
   }
 
-  Token tokenise_literal_number(string_view &source, size_t &column)
-  {
-    bool is_negative = false;
-    if (source[0] == '-')
-    {
-      is_negative = true;
-      source.remove_prefix(1);
-    }
-
-    auto end = source.find_first_not_of(VALID_DIGIT);
-    if (end == string::npos)
-      end = source.size() - 1;
-    string digits{source.substr(0, end)};
-    source.remove_prefix(end);
-
-    Token t{Token::Type::LITERAL_NUMBER, (is_negative ? "-" : "") + digits,
-            column};
-
-    column += digits.size() + (is_negative ? 1 : 0);
-
-    return t;
-  }
-
-  Token tokenise_literal_hex(string_view &source, size_t &column)
-  {
-    // Remove x char from source
-    source.remove_prefix(1);
-    auto end = source.find_first_not_of(VALID_HEX);
-    if (end == string::npos)
-      end = source.size() - 1;
-    string digits{source.substr(0, end)};
-    source.remove_prefix(end);
-
-    Token t = {Token::Type::LITERAL_NUMBER, "0x" + digits, column};
-
-    column += digits.size() + 1;
-    return t;
-  }
-
-  Err tokenise_literal_char(string_view &source_name, string_view &source,
-                            size_t &column, size_t &line, Token &t)
+  Err tokenise_literal_char(uint16_t file, size_t offset, string_view &source)
   {
     auto end = source.find('\'', 1);
     if (source.size() < 3 || end == 1 || end > 3)
-      return Err(Err::Type::INVALID_CHAR_LITERAL, column, line, source_name);
+      return Err(Err::Type::INVALID_CHAR_LITERAL, file, offset);
     else if (source[1] == '\\')
     {
       // Escape sequence
-      char escape = '\0';
       if (source.size() < 4 || source[3] != '\'')
-        return Err(Err::Type::INVALID_CHAR_LITERAL_ESCAPE_SEQUENCE, column,
-                   line, source_name);
+        return Err(Err::Type::INVALID_CHAR_LITERAL_ESCAPE_SEQUENCE, file,
+                   offset);
       switch (source[2])
       {
       case 'n':
-        escape = '\n';
-        break;
       case 't':
-        escape = '\t';
-        break;
       case 'r':
-        escape = '\r';
-        break;
       case '\\':
-        escape = '\\';
         break;
       default:
-        column += 2;
-        return Err(Err::Type::INVALID_CHAR_LITERAL_ESCAPE_SEQUENCE, column,
-                   line, source_name);
-        break;
+        return Err(Err::Type::INVALID_CHAR_LITERAL_ESCAPE_SEQUENCE, file,
+                   offset + 2);
       }
-      t = Token{Token::Type::LITERAL_CHAR, std::to_string(escape), column};
-      column += 4;
       source.remove_prefix(4);
     }
     else
-    {
-      t = Token{Token::Type::LITERAL_CHAR, std::to_string(source[1])};
-      column += 3;
       source.remove_prefix(3);
-    }
     return Err();
   }
 
-  Token tokenise_literal_string(string_view &source, size_t &column, size_t end)
+  Err tokenise_range(uint16_t file, size_t begin, size_t end,
+                     std::vector<Token *> &tokens, Arena &arena)
   {
-    source.remove_prefix(1);
-    Token token{Token::Type::LITERAL_STRING, string(source.substr(0, end - 1)),
-                column};
-    source.remove_prefix(end);
-    column += end + 1;
-    return token;
-  }
-
-  Err tokenise_buffer(string_view source_name, string_view source,
-                      std::vector<Token *> &tokens)
-  {
-    size_t column = 0, line = 1;
+    const string_view buffer = get_file(file).source.substr(0, end);
+    string_view source       = buffer.substr(begin);
     while (source.size() > 0)
     {
-      bool is_token = true;
-      char first    = source[0];
+      bool is_token       = true;
+      char first          = source[0];
+      const size_t offset = buffer.size() - source.size();
       Token t{};
-      if (isspace(first) || first == '\0')
+      if (is_class(first, CLASS_BLANK))
       {
-        size_t i;
-        for (i = 0;
-             i < source.size() && (isspace(source[i]) || source[i] == '\0');
-             ++i)
-        {
-          ++column;
-          if (source[i] == '\n')
-          {
-            column = 0;
-            ++line;
-          }
-        }
-        ++column;
-        source.remove_prefix(i);
+        source.remove_prefix(scan<Is_Blank>(source));
         is_token = false;
       }
       else if (first == ';')
       {
-        size_t i;
-        for (i = 0; i < source.size() && source[i] != '\n'; ++i)
-          continue;
-        column = 0;
-        ++line;
-        source.remove_prefix(i + 1);
+        source.remove_prefix(
+            std::min(scan<Is_Not_Newline>(source) + 1, source.size()));
         is_token = false;
       }
       else if (first == '*')
       {
-        t = Token{Token::Type::STAR, "", column};
+        t.type = Token::Type::STAR;
+        source.remove_prefix(1);
+      }
+      else if (first == '(' || first == ')')
+      {
+        t.type = first == '(' ? Token::Type::LEFT_PAREN
+                              : Token::Type::RIGHT_PAREN;
         source.remove_prefix(1);
       }
       else if (first == '\"')
       {
         auto end = source.find('\"', 1);
         if (end == string::npos)
-          return Err(Err::Type::INVALID_STRING_LITERAL, column, line,
-                     source_name);
-        t = tokenise_literal_string(source, column, end);
+          return Err(Err::Type::INVALID_STRING_LITERAL, file, offset);
+        t.type = Token::Type::LITERAL_STRING;
+        source.remove_prefix(end + 1);
       }
       else if (first == '\'')
       {
-        Err lerr = tokenise_literal_char(source_name, source, column, line, t);
+        Err lerr = tokenise_literal_char(file, offset, source);
         if (lerr.type != Err::Type::OK)
           return lerr;
+        t.type = Token::Type::LITERAL_CHAR;
       }
-      else if (isdigit(first) ||
-               (source.size() > 1 && first == '-' && isdigit(source[1])))
+      else if (is_class(first, CLASS_DIGIT) ||
+               (source.size() > 1 && first == '-' &&
+                is_class(source[1], CLASS_DIGIT)))
       {
-        auto end = source.find_first_not_of(VALID_DIGIT, first == '-' ? 1 : 0);
-        if (end == string::npos)
-          end = source.size() - 1;
-        else if (end != string::npos && !(isspace(source[end])))
-          return Err(Err::Type::INVALID_NUMBER_LITERAL, column, line,
-                     source_name);
-        t = tokenise_literal_number(source, column);
+        auto end = scan<Is_Digit>(source, first == '-' ? 1 : 0);
+        if (end != source.size() && !is_class(source[end], CLASS_SPACE))
+          return Err(Err::Type::INVALID_NUMBER_LITERAL, file, offset);
+        t.type = Token::Type::LITERAL_NUMBER;
+        source.remove_prefix(end);
       }
       else if (first == '0' && source.size() > 2 && source[1] == 'x' &&
-               is_char_in_s(source[2], VALID_HEX))
+               is_class(source[2], CLASS_HEX))
       {
-        auto end = source.find_first_not_of(VALID_HEX);
-        if (end == string::npos)
-          end = source.size() - 1;
-        else if (end != string::npos && !(isspace(source[end])))
-          return Err(Err::Type::INVALID_NUMBER_LITERAL, column, line,
-                     source_name);
-        t = tokenise_literal_hex(source, column);
+        auto end = scan<Is_Hex>(source, 2);
+        if (end != source.size() && !is_class(source[end], CLASS_SPACE))
+          return Err(Err::Type::INVALID_NUMBER_LITERAL, file, offset);
+        t.type = Token::Type::LITERAL_NUMBER;
+        source.remove_prefix(end);
       }
-      else if (is_char_in_s(first, VALID_SYMBOL))
+      else if (is_class(first, CLASS_SYMBOL))
       {
-        Err lerr;
-        lerr = tokenise_symbol(source_name, source, column, line, t);
+        Err lerr = tokenise_symbol(file, offset, source, t);
         if (lerr.type != Err::Type::OK)
           return lerr;
       }
       else
-      {
-        ++column;
-        return Err{Err::Type::UNKNOWN_LEXEME, column, line, source_name};
-      }
+        return Err{Err::Type::UNKNOWN_LEXEME, file, offset};
 
       if (is_token)
       {
-        t.source_name = source_name;
-        t.line        = line;
-        Token *acc    = new Token{t};
-        tokens.push_back(acc);
+        t.file   = file;
+        t.offset = offset;
+        t.size   = buffer.size() - source.size() - offset;
+        if (t.type == Token::Type::SYMBOL)
+          t.symbol = intern(buffer.substr(offset, t.size));
+        else if (t.type == Token::Type::PP_REFERENCE)
+          t.symbol = intern(buffer.substr(offset + 1, t.size - 1));
+        tokens.push_back(arena.make<Token>(t));
       }
     }
     return Err{};
   }
 
+  Err tokenise_buffer(uint16_t file, std::vector<Token *> &tokens, Arena &arena)
+  {
+    return tokenise_range(file, 0, get_file(file).source.size(), tokens, arena);
+  }
+
+  Err tokenise_range(uint16_t file, size_t begin, size_t end,
+                     std::vector<Token *> &tokens, Arena &arena,
+                     Thread_Pool &pool)
+  {
+    const string_view source = get_file(file).source;
+    const size_t chunks =
+        std::min(pool.size(), (end - begin) / LEXER_MIN_CHUNK_SIZE);
+    if (chunks <= 1)
+      return tokenise_range(file, begin, end, tokens, arena);
+
+    // Split at line breaks near each evenly spaced point
+    std::vector<size_t> bounds{begin};
+    for (size_t i = 1; i < chunks; ++i)
+    {
+      auto newline = source.find('\n', begin + i * (end - begin) / chunks);
+      if (newline == string::npos || newline + 1 >= end)
+        break;
+      if (newline + 1 > bounds.back())
+        bounds.push_back(newline + 1);
+    }
+    bounds.push_back(end);
+
+    const size_t n = bounds.size() - 1;
+    std::vector<std::vector<Token *>> results(n);
+    std::vector<Err> errors(n);
+    std::vector<Arena> arenas(n);
+    pool.parallel_for(n, [&](size_t i) {
+      errors[i] =
+          tokenise_range(file, bounds[i], bounds[i + 1], results[i], arenas[i]);
+    });
+
+    // Only strings may span lines, so a chunk boundary is at a token boundary
+    // unless the chunk before it failed to lex.  Chunks are stitched in order
+    // until the first failure, from where the rest of the range is lexed
+    // serially.  This reports the same error a serial lexer would, and
+    // recovers if the failure was due to a literal cut by the boundary.
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (errors[i].type != Err::Type::OK)
+        return tokenise_range(file, bounds[i], end, tokens, arena);
+      tokens.insert(tokens.end(), results[i].begin(), results[i].end());
+      arena.adopt(arenas[i]);
+    }
+    return Err{};
+  }
+
+  Err tokenise_buffer(uint16_t file, std::vector<Token *> &tokens, Arena &arena,
+                      Thread_Pool &pool)
+  {
+    return tokenise_range(file, 0, get_file(file).source.size(), tokens, arena,
+                          pool);
+  }
+
+  Stream::Stream(uint16_t file, Arena &arena, Thread_Pool *pool,
+                 bool transient)
+      : file{file}, arena{arena}, pool{pool}, offset{0}, index{0}, consumed{0},
+        retired{transient ? std::make_unique<Arena>() : nullptr}
+  {
+  }
+
+  Stream::Stream(uint16_t file, Arena &arena, std::vector<Token *> tokens,
+                 Err err)
+      : file{file}, arena{arena}, pool{nullptr},
+        offset{get_file(file).source.size()}, window{std::move(tokens)},
+        index{0}, consumed{0}, pending{err}
+  {
+  }
+
+  Stream::~Stream()
+  {
+    if (retired)
+      arena.adopt(*retired);
+  }
+
+  Token *Stream::next()
+  {
+    Token *token = peek();
+    if (token)
+    {
+      ++index;
+      ++consumed;
+    }
+    return token;
+  }
+
+  Token *Stream::peek()
+  {
+    if (index == window.size() && !fill())
+    {
+      err = pending;
+      return nullptr;
+    }
+    return window[index];
+  }
+
+  const Err &Stream::error() const
+  {
+    return err;
+  }
+
+  size_t Stream::count() const
+  {
+    return consumed;
+  }
+
+  bool Stream::transient() const
+  {
+    return retired != nullptr;
+  }
+
+  void Stream::release()
+  {
+    retired->free();
+    // Nor is the source before the current window needed, bar for errors
+    get_file(file).data.drop(window.empty() ? offset : window[0]->offset);
+  }
+
+  bool Stream::fill()
+  {
+    const string_view source = get_file(file).source;
+    size_t size              = LEXER_WINDOW_SIZE;
+    if (pool)
+      size = std::max(size, pool->size() * LEXER_MIN_CHUNK_SIZE);
+
+    window.clear();
+    index = 0;
+    if (retired)
+      retired->adopt(arena);
+    while (window.empty() && offset < source.size())
+    {
+      size_t end = source.find('\n', std::min(offset + size, source.size()));
+      end        = end == string::npos ? source.size() : end + 1;
+
+      Err lerr = pool ? tokenise_range(file, offset, end, window, arena, *pool)
+                      : tokenise_range(file, offset, end, window, arena);
+      if (lerr.type == Err::Type::OK)
+        offset = end;
+      else if (end == source.size())
+      {
+        pending = lerr;
+        offset  = end;
+      }
+      else
+      {
+        // Only strings may span lines, so this may be a literal cut short by
+        // the end of the window rather than an error.  Lex again from the
+        // last token with a larger window until the end of the file decides.
+        if (!window.empty())
+          offset = window.back()->offset + window.back()->size;
+        size *= 2;
+      }
+    }
+    return !window.empty();
+  }
+
+  // Stable storage for files, as tokens and errors refer to them throughout
+  // compilation.  Files may be added by one thread while others lex, so they're
+  // looked up through a table which never moves rather than the deque.
+  static std::deque<File> files;
+  static File *file_table[UINT16_MAX + 1];
+  static std::mutex files_lock;
+
+  uint16_t add_file(string name, Source source)
+  {
+    std::lock_guard<std::mutex> lock{files_lock};
+    if (files.size() > UINT16_MAX)
+    {
+      fprintf(stderr, "ERROR: more than %d files\n", UINT16_MAX + 1);
+      abort();
+    }
+    files.push_back({std::move(name), std::move(source), {}, {}, {}});
+    // Moving a small buffer moves its characters, so view it where it landed
+    files.back().source          = files.back().data.view();
+    file_table[files.size() - 1] = &files.back();
+    return files.size() - 1;
+  }
+
+  const File &get_file(uint16_t file)
+  {
+    return *file_table[file];
+  }
+
+  void edit_file(uint16_t file, size_t begin, size_t end, string_view text)
+  {
+    File &f = *file_table[file];
+    f.data.replace(begin, end, text);
+    f.source = f.data.view();
+    f.lines.clear();
+  }
+
+  void set_first_line(uint16_t file, std::function<size_t()> first_line)
+  {
+    file_table[file]->first_line = std::move(first_line);
+  }
+
+  Position get_position(uint16_t file, size_t offset)
+  {
+    File &f = *file_table[file];
+    if (f.lines.empty())
+    {
+      f.lines.push_back(0);
+      for (size_t i = 0; i < f.source.size(); ++i)
+        if (f.source[i] == '\n')
+          f.lines.push_back(i + 1);
+    }
+    // Find the last line starting at or before offset
+    auto line = std::upper_bound(f.lines.begin(), f.lines.end(), offset) - 1;
+    const size_t first = f.first_line ? f.first_line() : 0;
+    return {f.name, first + static_cast<size_t>(line - f.lines.begin()) + 1,
+            offset - *line + 1};
+  }
+
+  // Interned symbols, stored upper case, with an open addressed table of IDs
+  // keyed by a hash of the name.  Names are never removed so views of them
+  // stay valid.
+  struct Symbol_Table
+  {
+    struct Slot
+    {
+      // ID + 1 of the symbol, 0 if empty
+      uint32_t id;
+      uint32_t hash;
+    };
+
+    std::shared_mutex lock;
+    std::deque<string> names;
+    std::vector<Slot> slots = std::vector<Slot>(1024, Slot{0, 0});
+
+    // Slot of `name`, or the empty slot it belongs in
+    size_t find(string_view name, uint32_t hash) const
+    {
+      const size_t mask = slots.size() - 1;
+      for (size_t i = hash & mask;; i = (i + 1) & mask)
+        if (!slots[i].id ||
+            (slots[i].hash == hash && names[slots[i].id - 1] == name))
+          return i;
+    }
+
+    void grow()
+    {
+      std::vector<Slot> old(slots.size() * 2, Slot{0, 0});
+      std::swap(old, slots);
+      const size_t mask = slots.size() - 1;
+      for (const auto &slot : old)
+      {
+        if (!slot.id)
+          continue;
+        size_t i = slot.hash & mask;
+        for (; slots[i].id; i = (i + 1) & mask)
+          continue;
+        slots[i] = slot;
+      }
+    }
+  };
+
+  static Symbol_Table symbols;
+
+  uint32_t intern(string_view symbol)
+  {
+    thread_local string name;
+    name.resize(symbol.size());
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < symbol.size(); ++i)
+    {
+      name[i] = to_upper(symbol[i]);
+      hash ^= static_cast<uint8_t>(name[i]);
+      hash *= 1099511628211ull;
+    }
+    const uint32_t folded = hash ^ (hash >> 32);
+
+    {
+      std::shared_lock lock{symbols.lock};
+      const auto &slot = symbols.slots[symbols.find(name, folded)];
+      if (slot.id)
+        return slot.id - 1;
+    }
+
+    std::unique_lock lock{symbols.lock};
+    size_t slot = symbols.find(name, folded);
+    if (symbols.slots[slot].id)
+      return symbols.slots[slot].id - 1;
+    const uint32_t id = symbols.names.size();
+    symbols.names.push_back(name);
+    if (2 * symbols.names.size() > symbols.slots.size())
+    {
+      symbols.grow();
+      slot = symbols.find(name, folded);
+    }
+    symbols.slots[slot] = {id + 1, folded};
+    return id;
+  }
+
+  string_view symbol_name(uint32_t id)
+  {
+    std::shared_lock lock{symbols.lock};
+    return symbols.names[id];
+  }
+
+  size_t symbol_count()
+  {
+    std::shared_lock lock{symbols.lock};
+    return symbols.names.size();
+  }
+
   Token::Token()
+      : type{Type::SYMBOL}, operand_type{OperandType::NIL}, file{0}, offset{0},
+        size{0}, symbol{0}
   {
   }
 
-  Token::Token(Token::Type type, string_view content, size_t col, size_t line,
+  Token::Token(Token::Type type, uint16_t file, size_t offset, size_t size,
                OperandType optype)
-      : type{type}, operand_type{optype}, column{col}, line{line},
-        content{content}
+      : type{type}, operand_type{optype}, file{file},
+        offset{static_cast<uint32_t>(offset)},
+        size{static_cast<uint32_t>(size)}, symbol{0}
+  {
+  }
+
+  string_view Token::lexeme() const
+  {
+    return file_table[file]->source.substr(offset, size);
+  }
+
+  string_view Token::content() const
+  {
+    const auto lex = lexeme();
+    if (type == Type::SYMBOL || type == Type::LITERAL_NUMBER)
+      return lex;
+    else if (type == Type::PP_REFERENCE)
+      return lex.substr(1);
+    else if (type == Type::LITERAL_STRING || type == Type::LITERAL_CHAR)
+      return lex.substr(1, lex.size() - 2);
+    return "";
+  }
+
+  Position Token::position() const
   {
+    return get_position(file, offset);
   }
 
-  Err::Err()
+  Err::Err() : file{0}, offset{0}, type{Type::OK}
   {
   }
 
-  Err::Err(Err::Type type, size_t col, size_t line,
-           std::string_view source_name)
-      : source_name{source_name}, col{col}, line{line}, type{type}
+  Err::Err(Err::Type type, uint16_t file, size_t offset)
+      : file{file}, offset{offset}, type{type}
   {
   }
 
@@ -433,14 +1058,22 @@ namespace Lexer
       return "PP_USE";
     case Token::Type::PP_CONST:
       return "PP_CONST";
+    case Token::Type::PP_MACRO:
+      return "PP_MACRO";
     case Token::Type::PP_END:
       return "PP_END";
     case Token::Type::PP_REFERENCE:
       return "PP_REFERENCE";
     case Token::Type::GLOBAL:
       return "GLOBAL";
+    case Token::Type::NOINLINE:
+      return "NOINLINE";
     case Token::Type::STAR:
       return "STAR";
+    case Token::Type::LEFT_PAREN:
+      return "LEFT_PAREN";
+    case Token::Type::RIGHT_PAREN:
+      return "RIGHT_PAREN";
     case Token::Type::LITERAL_STRING:
       return "LITERAL_STRING";
     case Token::Type::LITERAL_NUMBER:
@@ -499,6 +1132,8 @@ namespace Lexer
       return "PRINT";
     case Token::Type::JUMP_ABS:
       return "JUMP_ABS";
+    case Token::Type::JUMP_STACK:
+      return "JUMP_STACK";
     case Token::Type::JUMP_IF:
       return "JUMP_IF";
     case Token::Type::CALL:
@@ -540,13 +1175,14 @@ namespace Lexer
   std::string to_string(const Token &t)
   {
     std::stringstream stream;
-    stream << t.source_name << ":" << t.line << ":" << t.column << ": "
+    const auto pos = t.position();
+    stream << pos.source_name << ":" << pos.line << ":" << pos.column << ": "
            << to_string(t.type);
 
     if (t.operand_type != Token::OperandType::NIL)
       stream << "[" << to_string(t.operand_type) << "]";
-    if (t.content != "")
-      stream << "(`" << t.content << "`)";
+    if (t.content() != "")
+      stream << "(`" << t.content() << "`)";
     return stream.str();
   }
 
@@ -580,7 +1216,8 @@ namespace Lexer
   std::string to_string(const Err &err)
   {
     std::stringstream stream;
-    stream << err.source_name << ":" << err.line << ":" << err.col << ": "
+    const auto pos = get_position(err.file, err.offset);
+    stream << pos.source_name << ":" << pos.line << ":" << pos.column << ": "
            << to_string(err.type);
     return stream.str();
   }
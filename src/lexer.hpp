@@ -17,23 +17,80 @@
 #ifndef LEXER_HPP
 #define LEXER_HPP
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <vector>
 
+#include <src/arena.hpp>
+#include <src/base.hpp>
+#include <src/thread_pool.hpp>
+
+// Smallest chunk of a file worth lexing on its own thread
+#define LEXER_MIN_CHUNK_SIZE (256 * 1024)
+// Bytes of a file a Lexer::Stream lexes at a time, per thread
+#define LEXER_WINDOW_SIZE (64 * 1024)
+
 namespace Lexer
 {
+  // Table of every source file seen during compilation.  Tokens refer to a
+  // file by its index in this table and to their text by a span into its
+  // source, which the table keeps alive until the end of compilation.
+  struct File
+  {
+    std::string name;
+    Source data;
+    std::string_view source;
+    // Offsets of the start of each line, computed on the first request for a
+    // position in this file.
+    std::vector<size_t> lines;
+    // Lines before this file's, if it holds a part of a larger source, asked
+    // for on each request for a position.
+    std::function<size_t()> first_line;
+  };
+
+  struct Position
+  {
+    std::string_view source_name;
+    size_t line, column;
+  };
+
+  // Files may be added and looked up from any thread.  Editing a file or asking
+  // for positions in it must not race with other uses of that file.
+  uint16_t add_file(std::string name, Source source);
+  const File &get_file(uint16_t file);
+  // Replace source[begin, end) of `file` with `text`.  Tokens of the file are
+  // not updated.
+  void edit_file(uint16_t file, size_t begin, size_t end,
+                 std::string_view text);
+  // Count lines of `file` on from `first_line()`, or from 0 if it's empty.
+  void set_first_line(uint16_t file, std::function<size_t()> first_line);
+  Position get_position(uint16_t file, size_t offset);
+
+  // Symbols are interned case insensitively into dense IDs from 0, so tables
+  // keyed by them can be flat vectors.  Safe to call from any thread.
+  uint32_t intern(std::string_view symbol);
+  // Upper case form of an interned symbol
+  std::string_view symbol_name(uint32_t id);
+  size_t symbol_count();
+
   struct Token
   {
-    enum class Type
+    enum class Type : uint8_t
     {
       // Preprocessor and other parse time constants
       PP_CONST,     // %const(<symbol>)...
+      PP_MACRO,     // %macro(<symbol>)(<symbol>...)...
       PP_USE,       // %use <string>
       PP_END,       // %end
       PP_REFERENCE, // $<symbol>
       GLOBAL,
+      NOINLINE,
       STAR,
+      LEFT_PAREN,
+      RIGHT_PAREN,
       // Literals
       LITERAL_NUMBER,
       LITERAL_CHAR,
@@ -67,11 +124,12 @@ namespace Lexer
       MULT,
       PRINT,
       JUMP_ABS,
+      JUMP_STACK,
       JUMP_IF,
       CALL,
       RET,
     } type;
-    enum class OperandType
+    enum class OperandType : uint8_t
     {
       NIL,
       BYTE,
@@ -84,18 +142,30 @@ namespace Lexer
       LONG
     } operand_type;
 
-    size_t column, line;
-    std::string source_name, content;
+    uint16_t file;
+    // Span of the token's lexeme in the source of `file`.
+    uint32_t offset, size;
+    // Interned content() of symbols and references, 0 for anything else.
+    uint32_t symbol;
 
     Token();
-    Token(Token::Type, std::string_view content = "", size_t col = 0,
-          size_t line = 0, OperandType type = OperandType::NIL);
+    Token(Token::Type, uint16_t file, size_t offset, size_t size,
+          OperandType type = OperandType::NIL);
+
+    // Text of the token as written in the source.
+    std::string_view lexeme() const;
+    // Text relevant to the token's type e.g. the name of a reference without
+    // the `$` or a string without its quotes.  Empty for mnemonics.
+    std::string_view content() const;
+    Position position() const;
   };
 
+  static_assert(sizeof(Token) <= 16, "Tokens should be compact");
+
   struct Err
   {
-    std::string_view source_name;
-    size_t col, line;
+    uint16_t file;
+    size_t offset;
     enum class Type
     {
       OK = 0,
@@ -111,11 +181,74 @@ namespace Lexer
 
     Err();
 
-    Err(Type type, size_t col, size_t line, std::string_view source_name = "");
+    Err(Type type, uint16_t file, size_t offset);
+  };
+
+  // Tokenise source[begin, end) of `file`, where `begin` must not be inside a
+  // token.  Offsets of tokens are relative to the whole file.
+  Err tokenise_range(uint16_t file, size_t begin, size_t end,
+                     std::vector<Token *> &vec, Arena &arena);
+  // Tokenise the source of `file`.  Tokens are allocated in `arena`, which
+  // owns them.
+  Err tokenise_buffer(uint16_t file, std::vector<Token *> &vec, Arena &arena);
+  // Tokenise source[begin, end) of `file` in chunks split at line breaks,
+  // lexed concurrently on `pool`.  The tokens and any error are the same as
+  // the serial version would produce.
+  Err tokenise_range(uint16_t file, size_t begin, size_t end,
+                     std::vector<Token *> &vec, Arena &arena,
+                     Thread_Pool &pool);
+  Err tokenise_buffer(uint16_t file, std::vector<Token *> &vec, Arena &arena,
+                      Thread_Pool &pool);
+
+  // Pull based source of the tokens of a file.  Tokens are lexed a window of
+  // lines at a time as they're asked for, so only the current window is held
+  // and nothing past the point a consumer stops at is lexed.  An error is only
+  // reported once the tokens before it have been consumed.
+  struct Stream
+  {
+    // If `transient`, `arena` must hold only the tokens of this stream: tokens
+    // of past windows are moved out of it as the stream moves on, and freed by
+    // release().
+    Stream(uint16_t file, Arena &arena, Thread_Pool *pool = nullptr,
+           bool transient = false);
+    // Stream over `tokens` already lexed from the whole of `file`, which ended
+    // in the error `err` if any.
+    Stream(uint16_t file, Arena &arena, std::vector<Token *> tokens, Err err);
+    // Tokens which weren't released go back to `arena`
+    ~Stream();
+
+    // Next token, or nullptr at the end of the file or an error.
+    Token *next();
+    Token *peek();
+    const Err &error() const;
+    // Number of tokens consumed so far
+    size_t count() const;
+
+    // Whether tokens may be freed after being consumed, so a consumer must copy
+    // any token it keeps.
+    bool transient() const;
+    // Free the tokens of windows before the current one, and let the source
+    // before it be dropped from memory.  Transient streams only, once no token
+    // pulled before the current window is used.
+    void release();
+
+  private:
+    uint16_t file;
+    Arena &arena;
+    Thread_Pool *pool;
+    // Start of the next window
+    size_t offset;
+    std::vector<Token *> window;
+    size_t index, consumed;
+    Err pending, err;
+    // Transient streams only: tokens of past windows, until released
+    std::unique_ptr<Arena> retired;
+
+    bool fill();
   };
 
-  Err tokenise_buffer(std::string_view source_name, std::string_view content,
-                      std::vector<Token *> &vec);
+  // Symbols are case insensitive, so compare and hash their upper case form.
+  std::string to_upper(std::string_view);
 
   std::string to_string(const Token::Type &);
   std::string to_string(const Token::OperandType &);
@@ -14,100 +14,289 @@
  * Description: Entrypoint for assembly program
  */
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <optional>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 extern "C"
 {
 #include <lib/inst.h>
 }
 
+#include <src/arena.hpp>
 #include <src/base.hpp>
+#include <src/cache.hpp>
 #include <src/lexer.hpp>
+#include <src/optimiser.hpp>
+#include <src/parser.hpp>
 #include <src/preprocesser.hpp>
+#include <src/thread_pool.hpp>
+#include <src/verifier.hpp>
 
 using std::cout, std::cerr, std::endl;
 using std::string, std::string_view, std::vector;
 
 using Lexer::Token;
 using Preprocesser::Unit;
-using Lex_Err = Lexer::Err;
-using PP_Err  = Preprocesser::Err;
+using Lex_Err   = Lexer::Err;
+using PP_Err    = Preprocesser::Err;
+using Parse_Err = Parser::Err;
+
+// Units preprocessed at a time when streaming bytecode
+#define STREAM_BATCH_SIZE 4096
 
 void usage(const char *program_name, FILE *fp)
 {
   fprintf(fp,
-          "Usage: %s FILE OUT-FILE\n"
-          "\tFILE: Source code to compile\n"
-          "\tOUT-FILE: Name of file to store bytecode\n",
+          "Usage: %s [OPTIONS] FILE OUT-FILE\n"
+          "\tFILE: Source code to compile, or - for standard input\n"
+          "\tOUT-FILE: Name of file to store bytecode\n"
+          "Options:\n"
+          "\t-jN: Use N threads\n"
+          "\t-c DIR: Cache lexed included files in DIR\n"
+          "\t-I DIR: Search DIR for included files\n"
+          "\t-MD: Write the files OUT-FILE depends on as a make rule, to "
+          "OUT-FILE with a .d extension\n"
+          "\t-MF FILE: Write the rule to FILE instead\n"
+          "\t-s: Stream bytecode to OUT-FILE as it's assembled, in memory "
+          "bounded by the labels used rather than the size of FILE\n"
+          "\t-m: Emit bytecode straight into OUT-FILE, mapped in memory, "
+          "encoding it in parallel\n"
+          "\t-O: Optimise the program before emitting it\n"
+          "\t-V: Verify the data stack of the program, following the "
+          "bytecode with how deep each routine takes it\n",
           program_name);
 }
 
+struct Options
+{
+  const char *source_name = nullptr, *out_name = nullptr;
+  const char *cache_dir   = nullptr;
+  size_t threads          = 0;
+  bool stream             = false;
+  bool map                = false;
+  bool optimise           = false;
+  bool verify             = false;
+  std::vector<const char *> include_dirs;
+  // Empty if no dependency file is wanted
+  string dependencies;
+};
+
+bool parse_options(int argc, const char *argv[], Options &options)
+{
+  std::vector<const char *> positional;
+  bool make_dependencies = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    string_view arg{argv[i]};
+    if (arg.size() > 2 && arg.substr(0, 2) == "-j")
+    {
+      char *end;
+      options.threads = strtoul(argv[i] + 2, &end, 10);
+      if (*end != '\0')
+        return false;
+    }
+    else if (arg == "-c")
+    {
+      if (++i == argc)
+        return false;
+      options.cache_dir = argv[i];
+    }
+    else if (arg.substr(0, 2) == "-I")
+    {
+      if (arg.size() == 2 && ++i == argc)
+        return false;
+      options.include_dirs.push_back(arg.size() > 2 ? argv[i] + 2 : argv[i]);
+    }
+    else if (arg == "-s")
+      options.stream = true;
+    else if (arg == "-m")
+      options.map = true;
+    else if (arg == "-O")
+      options.optimise = true;
+    else if (arg == "-V")
+      options.verify = true;
+    else if (arg == "-MD")
+      make_dependencies = true;
+    else if (arg == "-MF")
+    {
+      if (++i == argc)
+        return false;
+      make_dependencies    = true;
+      options.dependencies = argv[i];
+    }
+    else if (arg.size() > 1 && arg[0] == '-')
+      return false;
+    else
+      positional.push_back(argv[i]);
+  }
+  if (positional.size() == 0 || positional.size() > 2)
+    return false;
+  options.source_name = positional[0];
+  options.out_name    = positional.size() > 1 ? positional[1] : nullptr;
+
+  // Dependencies are of the output, and streamed or mapped bytecode goes
+  // straight to it, so there must be one
+  if ((make_dependencies || options.stream || options.map) &&
+      !options.out_name)
+    return false;
+  // Optimising and verifying take the whole program, so can't be done as
+  // it's emitted
+  else if (options.stream + options.map +
+               (options.optimise || options.verify) >
+           1)
+    return false;
+  else if (make_dependencies && options.dependencies.empty())
+  {
+    string_view out{options.out_name};
+    const auto extension = out.rfind('.');
+    if (extension != string_view::npos &&
+        out.find('/', extension) == string_view::npos)
+      out = out.substr(0, extension);
+    options.dependencies = string{out} + ".d";
+  }
+  return true;
+}
+
+// Escape `path` for a make rule
+string make_escape(string_view path)
+{
+  string escaped;
+  for (const char c : path)
+  {
+    if (c == '$')
+      escaped += '$';
+    else if (c == ' ' || c == '#')
+      escaped += '\\';
+    escaped += c;
+  }
+  return escaped;
+}
+
+// Write a make rule for `target` depending on `source` and every file included
+// while preprocessing it, as recorded in `file_map`, with an empty rule for
+// each included file so make copes with them being deleted.
+bool write_dependencies(const string &path, const char *target,
+                        const char *source, const Preprocesser::Map &file_map)
+{
+  vector<string_view> included;
+  for (const auto &[name, _] : file_map)
+    if (name != source)
+      included.push_back(name);
+  std::sort(included.begin(), included.end());
+
+  string rule = make_escape(target) + ":";
+  if (string_view{source} != "-")
+    rule += " " + make_escape(source);
+  for (const auto name : included)
+    rule += " \\\n  " + make_escape(name);
+  rule += "\n";
+  for (const auto name : included)
+    rule += "\n" + make_escape(name) + ":\n";
+
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp)
+    return false;
+  bool ok = fwrite(rule.data(), 1, rule.size(), fp) == rule.size();
+  ok      = fclose(fp) == 0 && ok;
+  return ok;
+}
+
+bool write_bytecode(const char *path, const vector<uint8_t> &bytecode)
+{
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return false;
+  bool ok = fwrite(bytecode.data(), 1, bytecode.size(), fp) == bytecode.size();
+  ok      = fclose(fp) == 0 && ok;
+  return ok;
+}
+
 int main(int argc, const char *argv[])
 {
-  if (argc == 1 || argc > 3)
+  Options options;
+  if (!parse_options(argc, argv, options))
   {
     usage(argv[0], stderr);
     return -1;
   }
   int ret                 = 0;
-  const char *source_name = argv[1];
-  const char *out_name    = argv[2];
-  (void)out_name;
+  const char *source_name = options.source_name;
+  const char *out_name    = options.out_name;
 
 #if VERBOSE >= 1
   INFO("ASSEMBLER", "Assembling `%s` to `%s`\n", source_name, out_name);
 #endif
 
-  auto file_source = read_file(source_name);
+  auto file_source = string_view{source_name} == "-" ? read_fd(STDIN_FILENO)
+                                                     : read_file(source_name);
+  const int read_error = file_source.has_value() ? 0 : errno;
 
 #if VERBOSE >= 1
   SUCCESS("ASSEMBLER", "`%s` -> %lu bytes\n", source_name,
-          file_source.has_value() ? file_source.value().size() : 0);
+          file_source.has_value() ? file_source.value().view().size() : 0);
 #endif
 
-  string source_str;
-  string_view original;
-  string_view src;
-  vector<Token *> tokens;
-  Lex_Err lerr;
+  Arena arena;
+  // When streaming, tokens of the source live here only as long as their
+  // batch, apart from the last window which may hold an error
+  Arena window;
+  Thread_Pool pool{options.threads};
+  uint16_t source_file;
 
-  Preprocesser::Map const_map, file_map;
-  vector<Token *> token_bag;
+  Preprocesser::Const_Map const_map;
+  Preprocesser::Map file_map;
   vector<Unit> units;
-  PP_Err *perr = nullptr;
+  Preprocesser::Tree tree;
+  PP_Err *perr         = nullptr;
+  Parse_Err *parse_err = nullptr;
+  vector<uint8_t> bytecode;
+  // Whether OUT-FILE has been opened to write bytecode into as it's assembled
+  bool partial = false;
+#if VERBOSE >= 1
+  size_t token_count = 0;
+#endif
+
+  // Found first, the source keeps its name when included by any other path
+  Preprocesser::Search_Path search;
+  for (const auto directory : options.include_dirs)
+    search.add(directory);
+  search.find(source_name);
 
   // Highest scoped variable cut off point
 
   if (file_source.has_value())
-    source_str = file_source.value();
-  else
+    source_file =
+        Lexer::add_file(source_name, std::move(file_source.value()));
+  else if (read_error == EFBIG)
   {
-    cerr << "ERROR: file `" << source_name << "` does not exist!" << endl;
+    cerr << "ERROR: file `" << source_name << "` is larger than "
+         << SOURCE_MAX_SIZE << " bytes!" << endl;
     ret = -1;
     goto end;
   }
-  original = string_view{source_str};
-  src      = string_view{source_str};
-  lerr     = tokenise_buffer(source_name, src, tokens);
-
-  if (lerr.type != Lex_Err::Type::OK)
+  else
   {
-    cerr << lerr << endl;
-    ret = 255 - static_cast<int>(lerr.type);
+    cerr << "ERROR: file `" << source_name << "` does not exist!" << endl;
+    ret = -1;
     goto end;
   }
-  else
-  {
-#if VERBOSE >= 1
-    SUCCESS("LEXER", "%lu bytes -> %lu tokens\n", source_str.size(),
-            tokens.size());
-#endif
 
 #if VERBOSE == 2
+  // Tokens are streamed into the preprocesser, so lex the whole file
+  // separately to show them
+  {
+    Arena scratch;
+    vector<Token *> tokens;
+    tokenise_buffer(source_file, tokens, scratch, pool);
     SUCCESS("LEXER", "Tokens parsed:%s\n", "");
     printf("-------------------------------------------------------------------"
            "-------------\n");
@@ -115,43 +304,216 @@ int main(int argc, const char *argv[])
       cout << "\t" << *token << endl;
     printf("-------------------------------------------------------------------"
            "-------------\n");
+    scratch.free();
+  }
+#endif
+
+  {
+    // With threads to spare, load included files while the preprocesser works
+    std::optional<Token_Cache> cache;
+    if (options.cache_dir)
+      cache.emplace(options.cache_dir);
+    Preprocesser::Includes includes{pool, cache ? &cache.value() : nullptr,
+                                    &search};
+    if (options.threads > 0)
+      includes.load(source_file);
+    Preprocesser::Includes *preloaded =
+        options.threads > 0 || cache ? &includes : nullptr;
+    Lexer::Stream tokens{source_file, options.stream ? window : arena, &pool,
+                         options.stream};
+    if (!options.stream)
+      perr = Preprocesser::preprocess(tokens, units, tree, arena, const_map,
+                                      file_map, 0, preloaded, &search);
+    else
+    {
+      int fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+      {
+        cerr << "ERROR: could not open `" << out_name << "`" << endl;
+        ret = -1;
+        goto end;
+      }
+      partial   = true;
+      bool more = true, written;
+#if VERBOSE >= 1
+      size_t streamed = 0;
+#endif
+      Parser::Batches batches{
+          units, tree,
+          [&]()
+          {
+            // Shared expansions of constants outlive the batch, as later ones
+            // may refer to them
+            units.clear();
+            tree.release();
+            if (!more || perr)
+              return false;
+            tokens.release();
+            perr = Preprocesser::preprocess(tokens, units, tree, arena,
+                                            const_map, file_map, 0, preloaded,
+                                            &search, STREAM_BATCH_SIZE);
+            more = units.size() == STREAM_BATCH_SIZE;
+#if VERBOSE >= 1
+            streamed += units.size();
+#endif
+#if VERBOSE == 2
+            for (const auto &unit : units)
+              cout << Preprocesser::to_string(unit, tree, 1) << endl;
+#endif
+            return !perr && !units.empty();
+          }};
+      parse_err = Parser::assemble(batches, fd, written, arena);
+      // Errors in the rest of the source come first, as without streaming
+      while (parse_err && batches.next())
+        continue;
+      written = close(fd) == 0 && written;
+      if (!written && !parse_err && !perr &&
+          tokens.error().type == Lex_Err::Type::OK)
+      {
+        cerr << "ERROR: could not write bytecode to `" << out_name << "`"
+             << endl;
+        ret = -1;
+      }
+#if VERBOSE >= 1
+      if (!parse_err && !perr)
+        SUCCESS("PARSER", "%lu units streamed to `%s`\n", streamed, out_name);
+#endif
+    }
+    if (tokens.error().type != Lex_Err::Type::OK)
+    {
+      cerr << tokens.error() << endl;
+      ret = 255 - static_cast<int>(tokens.error().type);
+      goto end;
+    }
+#if VERBOSE >= 1
+    token_count = tokens.count();
+    SUCCESS("LEXER", "%lu bytes -> %lu tokens\n",
+            Lexer::get_file(source_file).source.size(), token_count);
 #endif
   }
 
-  perr =
-      Preprocesser::preprocess(tokens, units, token_bag, const_map, file_map);
   if (perr)
   {
     cerr << *perr << endl;
     ret = 255 - static_cast<int>(perr->type);
     goto end;
   }
+  else if (ret != 0)
+    goto end;
   else
   {
 #if VERBOSE >= 1
-    SUCCESS("PREPROCESSER", "%lu tokens -> %lu units\n", tokens.size(),
-            units.size());
+    if (!options.stream)
+      SUCCESS("PREPROCESSER", "%lu tokens -> %lu units\n", token_count,
+              units.size());
 #endif
 
 #if VERBOSE == 2
-    SUCCESS("PREPROCESSER", "Units constructed:%s\n", "");
-    printf("-------------------------------------------------------------------"
-           "-------------\n");
-    for (auto unit : units)
-      cout << unit << endl;
-    printf("-------------------------------------------------------------------"
-           "-------------\n");
+    if (!options.stream)
+    {
+      SUCCESS("PREPROCESSER", "Units constructed:%s\n", "");
+      printf("---------------------------------------------------------------"
+             "-----------------\n");
+      for (const auto &unit : units)
+        cout << Preprocesser::to_string(unit, tree, 1) << endl;
+      printf("---------------------------------------------------------------"
+             "-----------------\n");
+    }
 #endif
+
+    if (!options.dependencies.empty() &&
+        !write_dependencies(options.dependencies, out_name, source_name,
+                            file_map))
+    {
+      cerr << "ERROR: could not write dependencies to `"
+           << options.dependencies << "`" << endl;
+      ret = -1;
+      goto end;
+    }
   }
 
-end:
-  for (auto token : tokens)
-    delete token;
+  if (options.map)
+  {
+    int fd = open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+      cerr << "ERROR: could not open `" << out_name << "`" << endl;
+      ret = -1;
+      goto end;
+    }
+    partial = true;
+    bool written;
+    parse_err = Parser::assemble(units, tree, fd, pool, written, arena);
+    written   = close(fd) == 0 && written;
+    if (!written && !parse_err)
+    {
+      cerr << "ERROR: could not write bytecode to `" << out_name << "`"
+           << endl;
+      ret = -1;
+      goto end;
+    }
+  }
+  else if (options.optimise || options.verify)
+  {
+    Parser::Program program;
+    parse_err = Parser::parse(units, tree, program, arena);
+    if (!parse_err && options.optimise)
+    {
+#if VERBOSE >= 1
+      const size_t parsed = program.instructions.size();
+#endif
+      Optimiser::optimise(program);
+#if VERBOSE >= 1
+      SUCCESS("OPTIMISER", "%lu instructions -> %lu instructions\n", parsed,
+              program.instructions.size());
+#endif
+    }
+    if (!parse_err && options.verify)
+    {
+      // Of the program as emitted, so after optimising
+      if (Verifier::Err *verr = Verifier::verify(program, arena))
+      {
+        cerr << *verr << endl;
+        ret = 255 - static_cast<int>(verr->type);
+        goto end;
+      }
+#if VERBOSE >= 1
+      SUCCESS("VERIFIER", "Stacks of %lu routines verified\n",
+              program.depths.size());
+#endif
+    }
+    if (!parse_err)
+      Parser::emit(program, bytecode);
+  }
+  else if (!options.stream)
+    parse_err = Parser::assemble(units, tree, bytecode, arena);
+  if (parse_err)
+  {
+    cerr << *parse_err << endl;
+    ret = 255 - static_cast<int>(parse_err->type);
+    goto end;
+  }
+#if VERBOSE >= 1
+  if (options.map)
+    SUCCESS("PARSER", "%lu units mapped to `%s`\n", units.size(), out_name);
+  else if (!options.stream)
+    SUCCESS("PARSER", "%lu units -> %lu bytes of bytecode\n", units.size(),
+            bytecode.size());
+#endif
 
-  for (auto token : token_bag)
-    delete token;
-  if (perr)
-    delete perr;
+  if (!options.stream && !options.map && out_name &&
+      !write_bytecode(out_name, bytecode))
+  {
+    cerr << "ERROR: could not write bytecode to `" << out_name << "`" << endl;
+    ret = -1;
+    goto end;
+  }
 
+end:
+  // Leave no partial bytecode behind
+  if (ret != 0 && partial)
+    remove(out_name);
+  window.free();
+  arena.free();
   return ret;
 }
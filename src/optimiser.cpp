@@ -0,0 +1,712 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-17
+ * Author: Aryadev Chavali
+ * Description: Passes rewriting parsed programs before they're emitted
+ */
+
+extern "C"
+{
+#include <lib/inst.h>
+}
+
+#include <src/optimiser.hpp>
+
+#include <algorithm>
+#include <initializer_list>
+#include <map>
+#include <optional>
+#include <set>
+#include <vector>
+
+namespace Optimiser
+{
+  using Parser::Instruction, Parser::Program, Parser::effect;
+
+  // Whether `op` is one of the `count` opcodes of the family at `base`
+  static bool in(uint8_t op, int base, int count)
+  {
+    return op >= base && op < base + count;
+  }
+
+  static bool takes_address(uint8_t op)
+  {
+    return op == OP_JUMP_ABS || op == OP_CALL || in(op, OP_JUMP_IF_BYTE, 3);
+  }
+
+  static bool jumps_to_computed(const Program &program)
+  {
+    for (const auto &instruction : program.instructions)
+      if (instruction.opcode == OP_JUMP_STACK ||
+          instruction.opcode == OP_CALL_STACK)
+        return true;
+    return false;
+  }
+
+  // Whether each instruction may be jumped to rather than only reached from
+  // the one before it
+  static std::vector<bool> jump_targets(const Program &program)
+  {
+    const auto &instructions = program.instructions;
+    std::vector<bool> target(instructions.size() + 1, false);
+    if (program.start < target.size())
+      target[program.start] = true;
+    for (const auto &instruction : instructions)
+      if (takes_address(instruction.opcode) &&
+          instruction.operand < target.size())
+        target[instruction.operand] = true;
+    return target;
+  }
+
+  // Whether execution never goes on to the instruction after `op`
+  static bool ends_flow(uint8_t op)
+  {
+    return op == OP_JUMP_ABS || op == OP_JUMP_STACK || op == OP_CALL_STACK ||
+           op == OP_RET || op == OP_HALT;
+  }
+
+  // Basic blocks of a program: runs of instructions only entered at their
+  // first and only left after their last
+  struct Blocks
+  {
+    // First instruction of each block, then the number of instructions
+    std::vector<uint64_t> starts;
+
+    Blocks(const Program &program)
+    {
+      const auto &instructions = program.instructions;
+      const auto target        = jump_targets(program);
+      for (uint64_t i = 0; i < instructions.size(); ++i)
+        if (i == 0 || target[i] || ends_flow(instructions[i - 1].opcode) ||
+            takes_address(instructions[i - 1].opcode))
+          starts.push_back(i);
+      starts.push_back(instructions.size());
+    }
+
+    size_t size() const
+    {
+      return starts.size() - 1;
+    }
+
+    // Block holding instruction `i`
+    size_t of(uint64_t i) const
+    {
+      return std::upper_bound(starts.begin(), starts.end(), i) -
+             starts.begin() - 1;
+    }
+
+    // Blocks execution may go on to after block `b`, returning how many.  A
+    // call goes on to both the routine and, once it returns, what follows.
+    size_t successors(const Program &program, size_t b, size_t next[2]) const
+    {
+      const Instruction &last = program.instructions[starts[b + 1] - 1];
+      size_t count            = 0;
+      if (takes_address(last.opcode) &&
+          last.operand < program.instructions.size())
+        next[count++] = of(last.operand);
+      if (!ends_flow(last.opcode) && b + 1 < size())
+        next[count++] = b + 1;
+      return count;
+    }
+  };
+
+  // Replace the instructions of `program` with `kept`, whose addresses are
+  // still those of the old instructions.  origins[i] is the first old
+  // instruction kept[i] stands for, in order; addresses of any old instruction
+  // left out go to the next one kept.
+  static void replace(Program &program, std::vector<Instruction> &kept,
+                      const std::vector<uint64_t> &origins)
+  {
+    const uint64_t old_size = program.instructions.size();
+    auto address            = [&](uint64_t old)
+    {
+      // Past the end stays as far past it
+      if (old > old_size)
+        return kept.size() + (old - old_size);
+      return static_cast<uint64_t>(
+          std::lower_bound(origins.begin(), origins.end(), old) -
+          origins.begin());
+    };
+    for (auto &instruction : kept)
+      if (takes_address(instruction.opcode))
+        instruction.operand = address(instruction.operand);
+    program.start        = address(program.start);
+    for (auto &routine : program.noinline)
+      routine = address(routine);
+    program.instructions = std::move(kept);
+  }
+
+  // Opcode pushing a literal of `width` bytes
+  static uint8_t push_opcode(size_t width)
+  {
+    return width == 1   ? OP_PUSH_BYTE
+           : width == 4 ? OP_PUSH_HWORD
+                        : OP_PUSH_WORD;
+  }
+
+  // Result of the binary operation `op` on the literals `a` and `b`, pushed in
+  // that order, or false if `op` can't be folded
+  static bool fold(uint8_t op, uint64_t a, uint64_t b, uint64_t &result)
+  {
+    const size_t bits   = effect(op).width * 8;
+    const uint64_t mask = bits == 64 ? UINT64_MAX : (1ULL << bits) - 1;
+    auto extend         = [&](uint64_t x)
+    { return static_cast<int64_t>(x << (64 - bits)) >> (64 - bits); };
+    // Signed types are every other opcode of a family, from the second
+    auto less = [&](int base)
+    { return (op - base) % 2 == 1 ? extend(a) < extend(b) : a < b; };
+
+    if (in(op, OP_PLUS_BYTE, 6))
+      result = (a + b) & mask;
+    else if (in(op, OP_SUB_BYTE, 6))
+      result = (a - b) & mask;
+    else if (in(op, OP_MULT_BYTE, 6))
+      result = (a * b) & mask;
+    else if (in(op, OP_OR_BYTE, 3))
+      result = a | b;
+    else if (in(op, OP_AND_BYTE, 3))
+      result = a & b;
+    else if (in(op, OP_XOR_BYTE, 3))
+      result = a ^ b;
+    else if (in(op, OP_EQ_BYTE, 3))
+      result = a == b;
+    else if (in(op, OP_LT_BYTE, 6))
+      result = less(OP_LT_BYTE);
+    else if (in(op, OP_LTE_BYTE, 6))
+      result = less(OP_LTE_BYTE) || a == b;
+    else if (in(op, OP_GT_BYTE, 6))
+      result = !less(OP_GT_BYTE) && a != b;
+    else if (in(op, OP_GTE_BYTE, 6))
+      result = !less(OP_GTE_BYTE);
+    else
+      return false;
+    return true;
+  }
+
+  // Instructions rewritten so far, each with the first old instruction it
+  // stands for and whether it may be jumped to
+  struct Rewritten
+  {
+    std::vector<Instruction> instructions;
+    std::vector<uint64_t> origins;
+    std::vector<bool> targets;
+    // Whether the next instruction is jumped to in place of any dropped
+    bool dropped_target = false;
+
+    void push_back(const Instruction &instruction, uint64_t origin,
+                   bool target)
+    {
+      instructions.push_back(instruction);
+      origins.push_back(origin);
+      targets.push_back(target || dropped_target);
+      dropped_target = false;
+    }
+
+    // Replace the last `count` instructions with `with`, which stand for the
+    // first of them
+    bool replace_tail(size_t count, std::initializer_list<Instruction> with)
+    {
+      const size_t first    = instructions.size() - count;
+      const uint64_t origin = origins[first];
+      const bool target     = targets[first];
+      instructions.resize(first);
+      origins.resize(first);
+      targets.resize(first);
+      dropped_target = dropped_target || (target && with.size() == 0);
+      for (const auto &instruction : with)
+      {
+        instructions.push_back(instruction);
+        origins.push_back(origin);
+        targets.push_back(instructions.size() == first + 1 && target);
+      }
+      return true;
+    }
+
+    // Rewrite the last instructions, returning whether they were
+    bool rewrite()
+    {
+      const size_t n = instructions.size();
+      if (n >= 2 && !targets[n - 1])
+      {
+        const Instruction a = instructions[n - 2], b = instructions[n - 1];
+        const auto &ea = effect(a.opcode), &eb = effect(b.opcode);
+        // Registers of the same type, if both access one
+        const bool same_register = a.operand == b.operand &&
+                                   ea.width == eb.width &&
+                                   ea.operand == 8 && eb.operand == 8;
+
+        if (in(b.opcode, OP_POP_BYTE, 3) && ea.pure && ea.pops == 0 &&
+            ea.pushes == eb.pops)
+          return replace_tail(2, {});
+        else if (in(a.opcode, OP_PUSH_BYTE, 3) &&
+                 in(b.opcode, OP_JUMP_IF_BYTE, 3) && ea.width == eb.width)
+          return a.operand != 0
+                     ? replace_tail(2, {{OP_JUMP_ABS, b.operand, b.token}})
+                     : replace_tail(2, {});
+        else if (in(a.opcode, OP_MOV_BYTE, 3) &&
+                 in(b.opcode, OP_PUSH_REGISTER_BYTE, 3) && same_register)
+        {
+          const uint8_t dup = OP_DUP_BYTE + (a.opcode - OP_MOV_BYTE);
+          return replace_tail(2, {{dup, 0, b.token}, a});
+        }
+        else if (in(a.opcode, OP_PUSH_REGISTER_BYTE, 3) &&
+                 in(b.opcode, OP_MOV_BYTE, 3) && same_register)
+          return replace_tail(2, {});
+      }
+      if (n >= 3 && !targets[n - 2] && !targets[n - 1])
+      {
+        const Instruction a = instructions[n - 3], b = instructions[n - 2],
+                          op = instructions[n - 1];
+        const auto &e = effect(op.opcode);
+        uint64_t result;
+        if (in(a.opcode, OP_PUSH_BYTE, 3) && in(b.opcode, OP_PUSH_BYTE, 3) &&
+            effect(a.opcode).width == e.width &&
+            effect(b.opcode).width == e.width &&
+            fold(op.opcode, a.operand, b.operand, result))
+          return replace_tail(3,
+                              {{push_opcode(e.pushes), result, op.token}});
+      }
+      return false;
+    }
+  };
+
+  void peephole(Program &program)
+  {
+    if (jumps_to_computed(program))
+      return;
+    const auto target = jump_targets(program);
+    Rewritten out;
+    out.instructions.reserve(program.instructions.size());
+    out.origins.reserve(program.instructions.size());
+    for (uint64_t i = 0; i < program.instructions.size(); ++i)
+    {
+      out.push_back(program.instructions[i], i, target[i]);
+      while (out.rewrite())
+        continue;
+    }
+    replace(program, out.instructions, out.origins);
+  }
+
+  void eliminate_dead_code(Program &program)
+  {
+    if (jumps_to_computed(program) ||
+        program.start >= program.instructions.size())
+      return;
+    const Blocks blocks{program};
+    std::vector<bool> reached(blocks.size(), false);
+    std::vector<size_t> stack{blocks.of(program.start)};
+    reached[stack.back()] = true;
+    while (!stack.empty())
+    {
+      size_t next[2];
+      const size_t b = stack.back();
+      stack.pop_back();
+      for (size_t i = 0, count = blocks.successors(program, b, next);
+           i < count; ++i)
+        if (!reached[next[i]])
+        {
+          reached[next[i]] = true;
+          stack.push_back(next[i]);
+        }
+    }
+
+    std::vector<Instruction> kept;
+    std::vector<uint64_t> origins;
+    for (size_t b = 0; b < blocks.size(); ++b)
+    {
+      if (!reached[b])
+        continue;
+      for (uint64_t i = blocks.starts[b]; i < blocks.starts[b + 1]; ++i)
+      {
+        kept.push_back(program.instructions[i]);
+        origins.push_back(i);
+      }
+    }
+    replace(program, kept, origins);
+  }
+
+  // End of the body of the routine at `address`, its ret, if it may be
+  // inlined: a leaf of straight line code of at most OPTIMISER_INLINE_LIMIT
+  // instructions, not named by `noinline`
+  static bool inlinable(const Program &program, uint64_t address,
+                        const std::vector<uint64_t> &noinline, uint64_t &end)
+  {
+    const auto &instructions = program.instructions;
+    if (std::binary_search(noinline.begin(), noinline.end(), address))
+      return false;
+    for (end = address; end < instructions.size() &&
+                        end - address <= OPTIMISER_INLINE_LIMIT;
+         ++end)
+    {
+      const uint8_t op = instructions[end].opcode;
+      if (op == OP_RET)
+        return true;
+      else if (ends_flow(op) || takes_address(op))
+        return false;
+    }
+    return false;
+  }
+
+  void inline_calls(Program &program)
+  {
+    if (jumps_to_computed(program))
+      return;
+    const auto &instructions = program.instructions;
+    std::vector<uint64_t> noinline{program.noinline};
+    std::sort(noinline.begin(), noinline.end());
+
+    std::vector<Instruction> kept;
+    std::vector<uint64_t> origins;
+    kept.reserve(instructions.size());
+    origins.reserve(instructions.size());
+    for (uint64_t i = 0; i < instructions.size(); ++i)
+    {
+      const Instruction &instruction = instructions[i];
+      uint64_t end;
+      if (instruction.opcode == OP_CALL &&
+          inlinable(program, instruction.operand, noinline, end))
+      {
+        // The body stands for the call, having no addresses of its own
+        for (uint64_t j = instruction.operand; j < end; ++j)
+        {
+          kept.push_back(instructions[j]);
+          origins.push_back(i);
+        }
+        continue;
+      }
+      kept.push_back(instruction);
+      origins.push_back(i);
+    }
+
+    // A routine returning straight to the caller's caller needn't be called
+    for (size_t i = 0; i + 1 < kept.size(); ++i)
+      if (kept[i].opcode == OP_CALL && kept[i + 1].opcode == OP_RET)
+        kept[i].opcode = OP_JUMP_ABS;
+    replace(program, kept, origins);
+  }
+
+  // Known bytes of the registers, by their offset from the first register
+  using Registers = std::map<uint64_t, uint8_t>;
+
+  // Offset of register `r` of `width` bytes, false if it doesn't fit a word
+  static bool register_offset(uint64_t r, size_t width, uint64_t &offset)
+  {
+    if (r > UINT64_MAX / width - 1)
+      return false;
+    offset = r * width;
+    return true;
+  }
+
+  // Bytes of registers moved to by any instruction, or pushed if `reads`
+  static std::set<uint64_t> accessed(const Program &program, bool reads)
+  {
+    const int base = reads ? OP_PUSH_REGISTER_BYTE : OP_MOV_BYTE;
+    std::set<uint64_t> bytes;
+    for (const auto &instruction : program.instructions)
+    {
+      const size_t width = effect(instruction.opcode).width;
+      uint64_t offset;
+      if (in(instruction.opcode, base, 3) &&
+          register_offset(instruction.operand, width, offset))
+        for (size_t i = 0; i < width; ++i)
+          bytes.insert(offset + i);
+    }
+    return bytes;
+  }
+
+  // Registers and values on the data stack known through a block, the
+  // stack being unknown below the values pushed in it
+  struct Known
+  {
+    struct Value
+    {
+      size_t width;
+      std::optional<uint64_t> value;
+    };
+    std::vector<Value> stack;
+    Registers registers;
+
+    std::optional<uint64_t> read(uint64_t r, size_t width) const
+    {
+      uint64_t offset, value = 0;
+      if (!register_offset(r, width, offset))
+        return std::nullopt;
+      // Registers are laid out little-endian
+      for (size_t i = 0; i < width; ++i)
+      {
+        const auto byte = registers.find(offset + i);
+        if (byte == registers.end())
+          return std::nullopt;
+        value |= static_cast<uint64_t>(byte->second) << (8 * i);
+      }
+      return value;
+    }
+
+    void write(uint64_t r, size_t width, std::optional<uint64_t> value)
+    {
+      uint64_t offset;
+      if (!register_offset(r, width, offset))
+        return;
+      for (size_t i = 0; i < width; ++i)
+        if (value)
+          registers[offset + i] = *value >> (8 * i);
+        else
+          registers.erase(offset + i);
+    }
+
+    // Pop `bytes` off the stack, returning the value popped if it's known
+    // and was pushed as that many bytes
+    std::optional<uint64_t> pop(size_t bytes)
+    {
+      if (!stack.empty() && stack.back().width == bytes)
+      {
+        const auto value = stack.back().value;
+        stack.pop_back();
+        return value;
+      }
+      for (; bytes > 0 && !stack.empty(); stack.pop_back())
+      {
+        // Popping part of a value loses track of the rest
+        if (stack.back().width > bytes)
+        {
+          stack.clear();
+          break;
+        }
+        bytes -= stack.back().width;
+      }
+      return std::nullopt;
+    }
+
+    void step(const Instruction &instruction)
+    {
+      const uint8_t op = instruction.opcode;
+      const auto &e    = effect(op);
+      if (in(op, OP_PUSH_BYTE, 3))
+        stack.push_back({e.width, instruction.operand});
+      else if (in(op, OP_PUSH_REGISTER_BYTE, 3))
+        stack.push_back({e.width, read(instruction.operand, e.width)});
+      else if (in(op, OP_MOV_BYTE, 3))
+        write(instruction.operand, e.width, pop(e.width));
+      else if (in(op, OP_DUP_BYTE, 3))
+      {
+        const uint64_t n = instruction.operand;
+        bool copied      = n < stack.size();
+        for (uint64_t i = 0; copied && i <= n; ++i)
+          copied = stack[stack.size() - 1 - i].width == e.width;
+        stack.push_back({e.width, copied ? stack[stack.size() - 1 - n].value
+                                         : std::nullopt});
+      }
+      else if (e.pure && e.pops == 2 * e.width && e.width > 0)
+      {
+        const auto b = pop(e.width), a = pop(e.width);
+        uint64_t result;
+        if (a && b && fold(op, *a, *b, result))
+          stack.push_back({e.pushes, result});
+        else
+          stack.push_back({e.pushes, std::nullopt});
+      }
+      else
+      {
+        pop(e.pops);
+        if (e.pushes)
+          stack.push_back({e.pushes, std::nullopt});
+      }
+    }
+  };
+
+  // Forget any register `from` doesn't know as the same, returning whether
+  // any was
+  static bool meet(Registers &into, const Registers &from)
+  {
+    bool changed = false;
+    for (auto it = into.begin(); it != into.end();)
+    {
+      const auto byte = from.find(it->first);
+      if (byte == from.end() || byte->second != it->second)
+      {
+        it      = into.erase(it);
+        changed = true;
+      }
+      else
+        ++it;
+    }
+    return changed;
+  }
+
+  // Replace loads of registers known on every path to them with literals
+  static void propagate_constants(Program &program, const Blocks &blocks)
+  {
+    auto &instructions = program.instructions;
+    // A routine called may have moved anything to any register moved to
+    const auto written = accessed(program, false);
+    std::vector<std::optional<Registers>> entry(blocks.size());
+    std::vector<size_t> work{blocks.of(program.start)};
+    entry[work.back()].emplace();
+    while (!work.empty())
+    {
+      const size_t b = work.back();
+      work.pop_back();
+      Known known{{}, *entry[b]};
+      for (uint64_t i = blocks.starts[b]; i < blocks.starts[b + 1]; ++i)
+        known.step(instructions[i]);
+
+      const uint8_t last = instructions[blocks.starts[b + 1] - 1].opcode;
+      Registers returned = known.registers;
+      for (const auto byte : written)
+        returned.erase(byte);
+      size_t next[2];
+      const size_t count = blocks.successors(program, b, next);
+      for (size_t i = 0; i < count; ++i)
+      {
+        // The last successor of a call is where it returns to
+        const bool returns = last == OP_CALL && next[i] == b + 1 &&
+                             i + 1 == count;
+        const Registers &registers = returns ? returned : known.registers;
+        if (!entry[next[i]])
+        {
+          entry[next[i]] = registers;
+          work.push_back(next[i]);
+        }
+        else if (meet(*entry[next[i]], registers))
+          work.push_back(next[i]);
+      }
+    }
+
+    for (size_t b = 0; b < blocks.size(); ++b)
+    {
+      if (!entry[b])
+        continue;
+      Known known{{}, *entry[b]};
+      for (uint64_t i = blocks.starts[b]; i < blocks.starts[b + 1]; ++i)
+      {
+        Instruction &instruction = instructions[i];
+        const size_t width       = effect(instruction.opcode).width;
+        if (in(instruction.opcode, OP_PUSH_REGISTER_BYTE, 3))
+          if (const auto value = known.read(instruction.operand, width))
+            instruction = {push_opcode(width), *value, instruction.token};
+        known.step(instruction);
+      }
+    }
+  }
+
+  // Turn the bytes of registers live after instructions [begin, end) into
+  // those live before them: pushed before they're next moved to
+  static void live_before(const Program &program, uint64_t begin, uint64_t end,
+                          std::set<uint64_t> &live)
+  {
+    for (uint64_t i = end; i-- > begin;)
+    {
+      const Instruction &instruction = program.instructions[i];
+      const size_t width             = effect(instruction.opcode).width;
+      uint64_t offset;
+      if (in(instruction.opcode, OP_MOV_BYTE, 3) &&
+          register_offset(instruction.operand, width, offset))
+        for (size_t j = 0; j < width; ++j)
+          live.erase(offset + j);
+      else if (in(instruction.opcode, OP_PUSH_REGISTER_BYTE, 3) &&
+               register_offset(instruction.operand, width, offset))
+        for (size_t j = 0; j < width; ++j)
+          live.insert(offset + j);
+    }
+  }
+
+  // Replace moves to registers which are moved to again, or never pushed,
+  // before they're next pushed with pops
+  static void eliminate_dead_stores(Program &program, const Blocks &blocks)
+  {
+    auto &instructions = program.instructions;
+    // A routine called, or one returned to, may push any register pushed
+    const auto read = accessed(program, true);
+    std::vector<std::vector<size_t>> predecessors(blocks.size());
+    for (size_t b = 0; b < blocks.size(); ++b)
+    {
+      size_t next[2];
+      for (size_t i = 0, count = blocks.successors(program, b, next);
+           i < count; ++i)
+        predecessors[next[i]].push_back(b);
+    }
+
+    // Bytes live on entering each block, and after it
+    std::vector<std::set<uint64_t>> live(blocks.size());
+    auto live_after = [&](size_t b)
+    {
+      const uint8_t last = instructions[blocks.starts[b + 1] - 1].opcode;
+      if (last == OP_CALL || last == OP_RET)
+        return read;
+      std::set<uint64_t> after;
+      size_t next[2];
+      for (size_t i = 0, count = blocks.successors(program, b, next);
+           i < count; ++i)
+        after.insert(live[next[i]].begin(), live[next[i]].end());
+      return after;
+    };
+    std::vector<size_t> work(blocks.size());
+    for (size_t b = 0; b < blocks.size(); ++b)
+      work[b] = b;
+    while (!work.empty())
+    {
+      const size_t b = work.back();
+      work.pop_back();
+      auto before = live_after(b);
+      live_before(program, blocks.starts[b], blocks.starts[b + 1], before);
+      if (before == live[b])
+        continue;
+      live[b] = std::move(before);
+      work.insert(work.end(), predecessors[b].begin(), predecessors[b].end());
+    }
+
+    for (size_t b = 0; b < blocks.size(); ++b)
+    {
+      auto after = live_after(b);
+      for (uint64_t i = blocks.starts[b + 1]; i-- > blocks.starts[b];)
+      {
+        Instruction &instruction = instructions[i];
+        const size_t width       = effect(instruction.opcode).width;
+        uint64_t offset;
+        if (in(instruction.opcode, OP_MOV_BYTE, 3) &&
+            register_offset(instruction.operand, width, offset))
+        {
+          const auto byte = after.lower_bound(offset);
+          if (byte == after.end() || *byte >= offset + width)
+          {
+            const uint8_t pop =
+                OP_POP_BYTE + (instruction.opcode - OP_MOV_BYTE);
+            instruction = {pop, 0, instruction.token};
+          }
+        }
+        live_before(program, i, i + 1, after);
+      }
+    }
+  }
+
+  void propagate_registers(Program &program)
+  {
+    if (jumps_to_computed(program) ||
+        program.start >= program.instructions.size())
+      return;
+    // Neither pass changes where blocks start
+    const Blocks blocks{program};
+    propagate_constants(program, blocks);
+    eliminate_dead_stores(program, blocks);
+  }
+
+  void optimise(Program &program)
+  {
+    // Inlined routines open up more to rewrite
+    inline_calls(program);
+    // Literals loaded from registers may then be folded
+    propagate_registers(program);
+    peephole(program);
+    // Folded jumps may leave more code unreachable
+    eliminate_dead_code(program);
+  }
+} // namespace Optimiser
@@ -0,0 +1,67 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-17
+ * Author: Aryadev Chavali
+ * Description: Passes rewriting parsed programs before they're emitted
+ */
+
+#ifndef OPTIMISER_HPP
+#define OPTIMISER_HPP
+
+#include <src/parser.hpp>
+
+// Instructions, besides its ret, of the largest routine inlined at its calls
+#define OPTIMISER_INLINE_LIMIT 32
+
+namespace Optimiser
+{
+  // Every pass keeps the behaviour of the program, retargetting addresses to
+  // the instructions left.  Programs which jump to addresses computed at run
+  // time (jump.stack) are left alone, as any address may be pushed.
+
+  // Rewrite runs of instructions in place, as described by Parser::effect:
+  //   - a value pushed then popped isn't pushed
+  //   - arithmetic and comparisons of literals are folded into a push of the
+  //     result, and a conditional jump on a literal into a jump or nothing
+  //   - a register stored then loaded is duplicated before the store instead,
+  //     and one loaded then stored back is left as it was
+  // Runs never span an instruction which may be jumped to.
+  void peephole(Parser::Program &program);
+
+  // Replace calls of small leaf routines with their bodies, unless the
+  // routine is named by `noinline`.  Only routines of straight line code
+  // ending in a ret, with no jumps or calls, are inlined.  A call followed by
+  // a ret becomes a jump to the routine, which then returns to the caller's
+  // caller.
+  void inline_calls(Parser::Program &program);
+
+  // Follow the values moved to registers across basic blocks:
+  //   - a register pushed where it holds the same literal on every path to
+  //     it is pushed as that literal instead
+  //   - a move to a register which is moved to again, or never pushed, before
+  //     it's next pushed becomes a pop
+  // Registers are taken as bytes, so those of different types overlap.  A
+  // call may move to or push any register any instruction does, and
+  // nothing is pushed after a halt.
+  void propagate_registers(Parser::Program &program);
+
+  // Drop the basic blocks which can't be reached from the start of the
+  // program.  Blocks are split at any instruction which may be jumped to and
+  // after any jump, call, ret or halt; a call is taken to return to the
+  // instruction after it.
+  void eliminate_dead_code(Parser::Program &program);
+
+  // Every pass above, in turn
+  void optimise(Parser::Program &program);
+} // namespace Optimiser
+
+#endif
@@ -0,0 +1,1038 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Parser and emitter of bytecode from preprocessed units
+ */
+
+extern "C"
+{
+#include <lib/inst.h>
+}
+
+#include <src/parser.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <optional>
+#include <sstream>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Offsets of the fields of the header in bytecode
+#define HEADER_START 0
+#define HEADER_COUNT 8
+#define HEADER_SIZE  16
+
+namespace Parser
+{
+  using TT  = Lexer::Token::Type;
+  using OT  = Lexer::Token::OperandType;
+  using ET  = Err::Type;
+  using Preprocesser::Unit;
+
+  // Typed opcodes are laid out as a base and one opcode per type, in the
+  // order of the suffixes the lexer accepts for them.
+  static_assert(OP_PUSH_WORD - OP_PUSH_BYTE == 2 &&
+                    OP_JUMP_IF_WORD - OP_JUMP_IF_BYTE == 2,
+                "Unsigned opcodes are BYTE, HWORD, WORD");
+  static_assert(OP_PRINT_LONG - OP_PRINT_BYTE == 5 &&
+                    OP_PRINT_CHAR - OP_PRINT_BYTE == 1,
+                "Signed opcodes are BYTE, CHAR, HWORD, INT, WORD, LONG");
+
+  // Offset of the opcode for `type` from the base of its family
+  int type_offset(OT type, bool is_signed)
+  {
+    switch (type)
+    {
+    case OT::BYTE:
+      return 0;
+    case OT::CHAR:
+      return 1;
+    case OT::HWORD:
+      return is_signed ? 2 : 1;
+    case OT::INT:
+      return 3;
+    case OT::WORD:
+      return is_signed ? 4 : 2;
+    case OT::LONG:
+      return 5;
+    case OT::NIL:
+    case OT::SHORT:
+    case OT::SSHORT:
+      break;
+    }
+    return 0;
+  }
+
+  enum class Operand
+  {
+    NONE,
+    LITERAL,
+    REGISTER,
+    ADDRESS,
+  };
+
+  // Opcode of an instruction token and the operand it takes, or false if
+  // `token` isn't an instruction.
+  bool opcode(const Lexer::Token &token, uint8_t &op, Operand &operand)
+  {
+    int base       = -1;
+    bool is_signed = false;
+    operand        = Operand::NONE;
+    switch (token.type)
+    {
+    case TT::NOOP:
+      op = OP_NOOP;
+      return true;
+    case TT::HALT:
+      op = OP_HALT;
+      return true;
+    case TT::MDELETE:
+      op = OP_MDELETE;
+      return true;
+    case TT::MSIZE:
+      op = OP_MSIZE;
+      return true;
+    case TT::JUMP_ABS:
+      op      = OP_JUMP_ABS;
+      operand = Operand::ADDRESS;
+      return true;
+    case TT::JUMP_STACK:
+      op = OP_JUMP_STACK;
+      return true;
+    case TT::CALL:
+      op      = OP_CALL;
+      operand = Operand::ADDRESS;
+      return true;
+    case TT::RET:
+      op = OP_RET;
+      return true;
+    case TT::PUSH:
+      base    = OP_PUSH_BYTE;
+      operand = Operand::LITERAL;
+      break;
+    case TT::POP:
+      base = OP_POP_BYTE;
+      break;
+    case TT::PUSH_REG:
+      base    = OP_PUSH_REGISTER_BYTE;
+      operand = Operand::REGISTER;
+      break;
+    case TT::MOV:
+      base    = OP_MOV_BYTE;
+      operand = Operand::REGISTER;
+      break;
+    case TT::DUP:
+      base    = OP_DUP_BYTE;
+      operand = Operand::REGISTER;
+      break;
+    case TT::MALLOC:
+      base = OP_MALLOC_BYTE;
+      break;
+    case TT::MSET:
+      base = OP_MSET_BYTE;
+      break;
+    case TT::MGET:
+      base = OP_MGET_BYTE;
+      break;
+    case TT::NOT:
+      base = OP_NOT_BYTE;
+      break;
+    case TT::OR:
+      base = OP_OR_BYTE;
+      break;
+    case TT::AND:
+      base = OP_AND_BYTE;
+      break;
+    case TT::XOR:
+      base = OP_XOR_BYTE;
+      break;
+    case TT::EQ:
+      base = OP_EQ_BYTE;
+      break;
+    case TT::JUMP_IF:
+      base    = OP_JUMP_IF_BYTE;
+      operand = Operand::ADDRESS;
+      break;
+    case TT::LT:
+      base      = OP_LT_BYTE;
+      is_signed = true;
+      break;
+    case TT::LTE:
+      base      = OP_LTE_BYTE;
+      is_signed = true;
+      break;
+    case TT::GT:
+      base      = OP_GT_BYTE;
+      is_signed = true;
+      break;
+    case TT::GTE:
+      base      = OP_GTE_BYTE;
+      is_signed = true;
+      break;
+    case TT::PLUS:
+      base      = OP_PLUS_BYTE;
+      is_signed = true;
+      break;
+    case TT::SUB:
+      base      = OP_SUB_BYTE;
+      is_signed = true;
+      break;
+    case TT::MULT:
+      base      = OP_MULT_BYTE;
+      is_signed = true;
+      break;
+    case TT::PRINT:
+      base      = OP_PRINT_BYTE;
+      is_signed = true;
+      break;
+    case TT::PP_CONST:
+    case TT::PP_MACRO:
+    case TT::PP_USE:
+    case TT::PP_END:
+    case TT::PP_REFERENCE:
+    case TT::GLOBAL:
+    case TT::NOINLINE:
+    case TT::STAR:
+    case TT::LEFT_PAREN:
+    case TT::RIGHT_PAREN:
+    case TT::LITERAL_NUMBER:
+    case TT::LITERAL_CHAR:
+    case TT::LITERAL_STRING:
+    case TT::SYMBOL:
+      return false;
+    }
+    op = base + type_offset(token.operand_type, is_signed);
+    return true;
+  }
+
+  // Bytes of the literal operand of a push
+  size_t literal_width(OT type)
+  {
+    switch (type)
+    {
+    case OT::BYTE:
+      return 1;
+    case OT::HWORD:
+      return 4;
+    case OT::NIL:
+    case OT::CHAR:
+    case OT::SHORT:
+    case OT::SSHORT:
+    case OT::INT:
+    case OT::WORD:
+    case OT::LONG:
+      break;
+    }
+    return 8;
+  }
+
+  // Parse a number literal which must fit in `width` bytes, as either a
+  // signed or an unsigned integer.  Negative numbers are stored in two's
+  // complement.
+  bool parse_number(std::string_view text, size_t width, uint64_t &value)
+  {
+    const bool negative = text[0] == '-';
+    if (negative)
+      text.remove_prefix(1);
+    uint64_t magnitude = 0;
+    for (const char c : text)
+    {
+      const uint64_t digit = c - '0';
+      if (magnitude > (UINT64_MAX - digit) / 10)
+        return false;
+      magnitude = magnitude * 10 + digit;
+    }
+    const uint64_t max = width == 8 ? UINT64_MAX : (1ULL << (width * 8)) - 1;
+    if (negative ? magnitude > max / 2 + 1 : magnitude > max)
+      return false;
+    value = negative ? (~magnitude + 1) & max : magnitude;
+    return true;
+  }
+
+  uint8_t parse_char(std::string_view text)
+  {
+    if (text[0] != '\\')
+      return text[0];
+    switch (text[1])
+    {
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    case 'r':
+      return '\r';
+    default:
+      return text[1];
+    }
+  }
+
+  // Write the low `width` bytes of `value` to `out`, most significant first
+  static void write_be(uint8_t *out, uint64_t value, size_t width)
+  {
+    for (size_t i = 0; i < width; ++i)
+      out[i] = value >> (8 * (width - i - 1));
+  }
+
+  // Pulls the tokens units expand to, skipping directives whose expansion
+  // follows them.  Tokens are copied out, as those of a batch may be freed
+  // once the next batch is pulled.
+  struct Leaves
+  {
+    const Preprocesser::Tree &tree;
+    std::optional<Preprocesser::Walk> walk;
+    Batches *batches;
+
+    bool next(Lexer::Token &token)
+    {
+      int depth;
+      while (true)
+      {
+        for (const Unit *unit; (unit = walk->next(depth));)
+          if (unit->root->type != TT::PP_REFERENCE &&
+              unit->root->type != TT::PP_USE)
+          {
+            token = *unit->root;
+            return true;
+          }
+        if (!batches || !batches->next())
+          return false;
+        walk.emplace(tree, Slice<const Unit>{batches->units.data(),
+                                             batches->units.size()});
+      }
+    }
+  };
+
+  // Bytecode held in memory, grown as needed
+  struct Buffer_Output
+  {
+    static constexpr bool encodes = true;
+    std::vector<uint8_t> &bytecode;
+    size_t written;
+
+    void mark(const Leaves &, uint64_t)
+    {
+    }
+
+    void emit(uint8_t op, uint64_t value, size_t width, const Lexer::Token &)
+    {
+      if (written + 1 + width > bytecode.size())
+        bytecode.resize(std::max(bytecode.size() * 2, written + 1 + width));
+      bytecode[written] = op;
+      write_be(bytecode.data() + written + 1, value, width);
+      written += 1 + width;
+    }
+
+    size_t operand() const
+    {
+      return written - 8;
+    }
+
+    void patch(size_t offset, uint64_t value)
+    {
+      write_be(bytecode.data() + offset, value, 8);
+    }
+
+    void header(uint64_t start, uint64_t count)
+    {
+      patch(HEADER_START, start);
+      patch(HEADER_COUNT, count);
+    }
+
+    void noinline(uint64_t)
+    {
+    }
+  };
+
+  // Bytecode written to a file through a buffer of PARSER_BUFFER_SIZE bytes.
+  // Words already written out are patched in place with pwrite.
+  struct File_Output
+  {
+    static constexpr bool encodes = true;
+    int fd;
+    std::vector<uint8_t> buffer;
+    size_t flushed;
+    bool ok;
+
+    size_t size() const
+    {
+      return flushed + buffer.size();
+    }
+
+    void mark(const Leaves &, uint64_t)
+    {
+    }
+
+    void flush()
+    {
+      for (size_t done = 0; ok && done < buffer.size();)
+      {
+        const ssize_t n = write(fd, buffer.data() + done, buffer.size() - done);
+        if (n < 0 && errno != EINTR)
+          ok = false;
+        else if (n > 0)
+          done += n;
+      }
+      flushed += buffer.size();
+      buffer.clear();
+    }
+
+    void emit(uint8_t op, uint64_t value, size_t width, const Lexer::Token &)
+    {
+      if (buffer.size() + 1 + width > PARSER_BUFFER_SIZE)
+        flush();
+      buffer.push_back(op);
+      buffer.resize(buffer.size() + width);
+      write_be(buffer.data() + buffer.size() - width, value, width);
+    }
+
+    size_t operand() const
+    {
+      return size() - 8;
+    }
+
+    void patch(size_t offset, uint64_t value)
+    {
+      uint8_t word[8];
+      write_be(word, value, 8);
+      if (offset >= flushed)
+        std::copy(word, word + 8, buffer.data() + offset - flushed);
+      else if (ok && pwrite(fd, word, 8, offset) != 8)
+        ok = false;
+    }
+
+    void header(uint64_t start, uint64_t count)
+    {
+      patch(HEADER_START, start);
+      patch(HEADER_COUNT, count);
+    }
+
+    void noinline(uint64_t)
+    {
+    }
+  };
+
+  // Instructions held as a program, for passes over them before emitting
+  struct Program_Output
+  {
+    static constexpr bool encodes = true;
+    Program &program;
+    // Holds the token of each instruction
+    Arena &arena;
+
+    void mark(const Leaves &, uint64_t)
+    {
+    }
+
+    void emit(uint8_t op, uint64_t value, size_t, const Lexer::Token &token)
+    {
+      program.instructions.push_back(
+          {op, value, arena.make<Lexer::Token>(token)});
+    }
+
+    size_t operand() const
+    {
+      return program.instructions.size() - 1;
+    }
+
+    void patch(size_t index, uint64_t value)
+    {
+      program.instructions[index].operand = value;
+    }
+
+    void header(uint64_t start, uint64_t)
+    {
+      program.start = start;
+    }
+
+    void noinline(uint64_t address)
+    {
+      program.noinline.push_back(address);
+    }
+  };
+
+  // Lays out bytecode without encoding any operands, marking where each chunk
+  // of PARSER_CHUNK_SIZE instructions starts so they may be encoded apart.
+  struct Layout
+  {
+    static constexpr bool encodes = false;
+    struct Chunk
+    {
+      Preprocesser::Walk walk;
+      size_t offset;
+      uint64_t index;
+    };
+    std::vector<Chunk> chunks;
+    size_t written;
+    // Instructions laid out, which stops short of any error
+    uint64_t instructions;
+    uint64_t start, count;
+
+    // Called before each token is pulled from `leaves`
+    void mark(const Leaves &leaves, uint64_t index)
+    {
+      if (index == chunks.size() * PARSER_CHUNK_SIZE)
+        chunks.push_back({*leaves.walk, written, index});
+      instructions = index;
+    }
+
+    void emit(uint8_t, uint64_t, size_t width, const Lexer::Token &)
+    {
+      written += 1 + width;
+    }
+
+    // Operands aren't encoded, so there are no fixups
+    size_t operand() const
+    {
+      return 0;
+    }
+
+    void patch(size_t, uint64_t)
+    {
+    }
+
+    void header(uint64_t start, uint64_t count)
+    {
+      this->start = start;
+      this->count = count;
+    }
+
+    void noinline(uint64_t)
+    {
+    }
+  };
+
+  // A label referred to before its definition, to be written as a word at
+  // `offset` of the bytecode
+  struct Fixup
+  {
+    size_t offset;
+    Lexer::Token label;
+  };
+
+  // Label addresses by symbol ID
+  struct Labels
+  {
+    static constexpr uint64_t UNDEFINED = UINT64_MAX;
+    std::vector<uint64_t> addresses;
+
+    uint64_t &operator[](uint32_t id)
+    {
+      if (id >= addresses.size())
+        addresses.resize(std::max<size_t>(id + 1, Lexer::symbol_count()),
+                         UNDEFINED);
+      return addresses[id];
+    }
+
+    uint64_t find(uint32_t id) const
+    {
+      return id < addresses.size() ? addresses[id] : UNDEFINED;
+    }
+  };
+
+  // Errors hold a copy of their token, which may not outlive the batch
+  static Err *error(ET type, const Lexer::Token &token, Arena &arena)
+  {
+    return arena.make<Err>(type, arena.make<Lexer::Token>(token));
+  }
+
+  bool is_label(const Lexer::Token &token)
+  {
+    return token.type == TT::SYMBOL && token.size > 1 &&
+           token.lexeme().back() == ':';
+  }
+
+  // Bytes of the operand following an opcode
+  size_t operand_width(Operand operand, OT type)
+  {
+    switch (operand)
+    {
+    case Operand::NONE:
+      return 0;
+    case Operand::LITERAL:
+      return literal_width(type);
+    case Operand::REGISTER:
+    case Operand::ADDRESS:
+      break;
+    }
+    return 8;
+  }
+
+  // Pull the tokens of the operand the instruction `token` takes into `arg`,
+  // and `offset` for a relative address, checking they're of the right type.
+  static Err *read_operand(Leaves &leaves, Operand operand,
+                           const Lexer::Token &token, Lexer::Token &arg,
+                           Lexer::Token &offset, Arena &arena)
+  {
+    if (operand == Operand::NONE)
+      return nullptr;
+    const bool has_arg = leaves.next(arg);
+    switch (operand)
+    {
+    case Operand::NONE:
+      break;
+    case Operand::LITERAL:
+      if (!has_arg ||
+          (arg.type != TT::LITERAL_CHAR && arg.type != TT::LITERAL_NUMBER))
+        return error(ET::EXPECTED_LITERAL, has_arg ? arg : token, arena);
+      break;
+    case Operand::REGISTER:
+      if (!has_arg || arg.type != TT::LITERAL_NUMBER)
+        return error(ET::EXPECTED_REGISTER, has_arg ? arg : token, arena);
+      break;
+    case Operand::ADDRESS:
+      if (has_arg && arg.type == TT::STAR)
+      {
+        const bool has_offset = leaves.next(offset);
+        if (!has_offset || offset.type != TT::LITERAL_NUMBER)
+          return error(ET::EXPECTED_ADDRESS, has_offset ? offset : arg, arena);
+      }
+      else if (!has_arg ||
+               (arg.type != TT::SYMBOL && arg.type != TT::LITERAL_NUMBER))
+        return error(ET::EXPECTED_ADDRESS, has_arg ? arg : token, arena);
+      break;
+    }
+    return nullptr;
+  }
+
+  // Value of an operand pulled by read_operand for the instruction at `index`,
+  // unless it's a label.  Returns the token out of bounds, if any.
+  const Lexer::Token *operand_value(Operand operand, OT type,
+                                    const Lexer::Token &arg,
+                                    const Lexer::Token &offset, uint64_t index,
+                                    uint64_t &value)
+  {
+    value = 0;
+    switch (operand)
+    {
+    case Operand::NONE:
+      break;
+    case Operand::LITERAL:
+      if (arg.type == TT::LITERAL_CHAR)
+        value = parse_char(arg.content());
+      else if (!parse_number(arg.content(), literal_width(type), value))
+        return &arg;
+      break;
+    case Operand::ADDRESS:
+      if (arg.type == TT::STAR)
+      {
+        // Relative to this instruction
+        const auto text     = offset.content();
+        const bool negative = text[0] == '-';
+        if (!parse_number(negative ? text.substr(1) : text, 8, value) ||
+            (negative ? value > index : value > UINT64_MAX - index))
+          return &offset;
+        value = negative ? index - value : index + value;
+        break;
+      }
+      [[fallthrough]];
+    case Operand::REGISTER:
+      if (arg.lexeme()[0] == '-' || !parse_number(arg.content(), 8, value))
+        return &arg;
+      break;
+    }
+    return nullptr;
+  }
+
+  // Assemble every token pulled from `leaves` into `out`, which provides:
+  //   encodes: whether operands are encoded, or only laid out
+  //   mark(leaves, index): called before each token is pulled, with the
+  //   index of the next instruction
+  //   emit(op, value, width, token): write an instruction parsed from
+  //   `token`, its operand being `width` bytes
+  //   operand(): where the operand of the last instruction, a word, was
+  //   written
+  //   patch(operand, value): overwrite that operand
+  //   header(start, count): write the header, once the rest is written
+  //   noinline(address): note a routine named by `noinline`
+  // Only labels and fixups are kept, so memory is bounded by those and
+  // whatever `out` holds.
+  template <typename Output>
+  static Err *assemble(Leaves &leaves, Output &out, Labels &labels,
+                       Arena &arena)
+  {
+    std::vector<Fixup> fixups;
+    // Labels named by `noinline`, resolved once all are defined
+    std::vector<Lexer::Token> noinline;
+    uint64_t instructions = 0;
+    bool has_global       = false;
+    Lexer::Token global, token, arg, offset;
+
+    for (out.mark(leaves, instructions); leaves.next(token);
+         out.mark(leaves, instructions))
+    {
+      if (token.type == TT::GLOBAL)
+      {
+        // Only the last global has an effect, so it replaces any before it
+        const bool named = leaves.next(global);
+        if (!named || global.type != TT::SYMBOL)
+          return error(ET::EXPECTED_SYMBOL_FOR_GLOBAL, named ? global : token,
+                       arena);
+        has_global = true;
+        continue;
+      }
+      else if (token.type == TT::NOINLINE)
+      {
+        Lexer::Token label;
+        const bool named = leaves.next(label);
+        if (!named || label.type != TT::SYMBOL)
+          return error(ET::EXPECTED_SYMBOL_FOR_NOINLINE, named ? label : token,
+                       arena);
+        noinline.push_back(label);
+        continue;
+      }
+      else if (is_label(token))
+      {
+        const auto name   = token.lexeme().substr(0, token.size - 1);
+        uint64_t &address = labels[Lexer::intern(name)];
+        if (address != Labels::UNDEFINED)
+          return error(ET::DUPLICATE_LABEL, token, arena);
+        address = instructions;
+        continue;
+      }
+
+      uint8_t op;
+      Operand operand;
+      if (!opcode(token, op, operand))
+        return error(ET::EXPECTED_INSTRUCTION, token, arena);
+      if (Err *err = read_operand(leaves, operand, token, arg, offset, arena))
+        return err;
+
+      uint64_t value = 0;
+      bool fixup     = false;
+      if constexpr (Output::encodes)
+      {
+        if (operand == Operand::ADDRESS && arg.type == TT::SYMBOL)
+        {
+          // Write the address of the label, or leave a fixup
+          value = labels[arg.symbol];
+          fixup = value == Labels::UNDEFINED;
+          if (fixup)
+            value = 0;
+        }
+        else if (const auto *bad = operand_value(
+                     operand, token.operand_type, arg, offset, instructions,
+                     value))
+          return error(ET::OPERAND_OUT_OF_BOUNDS, *bad, arena);
+      }
+      out.emit(op, value, operand_width(operand, token.operand_type), token);
+      if (fixup)
+        fixups.push_back({out.operand(), arg});
+      ++instructions;
+    }
+
+    for (const auto &fixup : fixups)
+    {
+      const uint64_t address = labels[fixup.label.symbol];
+      if (address == Labels::UNDEFINED)
+        return error(ET::UNKNOWN_LABEL, fixup.label, arena);
+      out.patch(fixup.offset, address);
+    }
+    if (has_global && labels[global.symbol] == Labels::UNDEFINED)
+      return error(ET::UNKNOWN_LABEL, global, arena);
+    for (const auto &label : noinline)
+    {
+      if (labels[label.symbol] == Labels::UNDEFINED)
+        return error(ET::UNKNOWN_LABEL, label, arena);
+      out.noinline(labels[label.symbol]);
+    }
+    out.header(has_global ? labels[global.symbol] : 0, instructions);
+    return nullptr;
+  }
+
+  // Encode instructions [chunk.index, end) of a layout into `bytecode`, or
+  // only check them if it's nullptr.  The layout has checked their tokens, so
+  // only operand values may be at fault: the first out of bounds and the first
+  // label left undefined are kept.  Touches nothing shared but `bytecode`.
+  static void encode(const Preprocesser::Tree &tree, const Layout::Chunk &chunk,
+                     uint64_t end, const Labels &labels, uint8_t *bytecode,
+                     std::optional<Lexer::Token> &bounds,
+                     std::optional<Lexer::Token> &unknown)
+  {
+    Leaves leaves{tree, chunk.walk, nullptr};
+    size_t written = chunk.offset;
+    Lexer::Token token, arg, offset;
+    for (uint64_t index = chunk.index; index < end && leaves.next(token);)
+    {
+      if (token.type == TT::GLOBAL || token.type == TT::NOINLINE)
+      {
+        leaves.next(token);
+        continue;
+      }
+      else if (is_label(token))
+        continue;
+
+      uint8_t op;
+      Operand operand;
+      opcode(token, op, operand);
+      if (operand != Operand::NONE && leaves.next(arg) && arg.type == TT::STAR)
+        leaves.next(offset);
+
+      uint64_t value = 0;
+      if (operand == Operand::ADDRESS && arg.type == TT::SYMBOL)
+      {
+        value = labels.find(arg.symbol);
+        if (value == Labels::UNDEFINED && !unknown)
+          unknown = arg;
+      }
+      else if (const auto *bad = operand_value(operand, token.operand_type,
+                                               arg, offset, index, value))
+      {
+        bounds = *bad;
+        return;
+      }
+
+      const size_t width = operand_width(operand, token.operand_type);
+      if (bytecode)
+      {
+        bytecode[written] = op;
+        write_be(bytecode + written + 1, value, width);
+      }
+      written += 1 + width;
+      ++index;
+    }
+  }
+
+  Err *assemble(const std::vector<Unit> &units, const Preprocesser::Tree &tree,
+                std::vector<uint8_t> &bytecode, Arena &arena)
+  {
+    Leaves leaves{tree, {}, nullptr};
+    leaves.walk.emplace(tree, Slice<const Unit>{units.data(), units.size()});
+    Buffer_Output out{bytecode, HEADER_SIZE};
+    Labels labels;
+    bytecode.resize(HEADER_SIZE +
+                    PARSER_BYTES_PER_UNIT * (units.size() + tree.size()));
+    Err *err = assemble(leaves, out, labels, arena);
+    bytecode.resize(out.written);
+    return err;
+  }
+
+  Err *assemble(Batches &batches, int fd, bool &written, Arena &arena)
+  {
+    Leaves leaves{batches.tree, {}, &batches};
+    leaves.walk.emplace(batches.tree, Slice<const Unit>{batches.units.data(),
+                                                        batches.units.size()});
+    File_Output out{fd, std::vector<uint8_t>(HEADER_SIZE), 0, true};
+    Labels labels;
+    out.buffer.reserve(PARSER_BUFFER_SIZE);
+    Err *err = assemble(leaves, out, labels, arena);
+    if (!err)
+      out.flush();
+    written = out.ok;
+    return err;
+  }
+
+  Err *assemble(const std::vector<Unit> &units, const Preprocesser::Tree &tree,
+                int fd, Thread_Pool &pool, bool &written, Arena &arena)
+  {
+    Leaves leaves{tree, {}, nullptr};
+    leaves.walk.emplace(tree, Slice<const Unit>{units.data(), units.size()});
+    Layout layout{{}, HEADER_SIZE, 0, 0, 0};
+    Labels labels;
+    Err *err = assemble(leaves, layout, labels, arena);
+
+    // Map the file only once it's known there's bytecode to write.  Any
+    // instructions laid out before an error are still checked, as their
+    // operands may be at fault first.
+    uint8_t *bytecode = nullptr;
+    written           = true;
+    if (!err)
+    {
+      void *map = MAP_FAILED;
+      if (ftruncate(fd, layout.written) == 0)
+        map = mmap(nullptr, layout.written, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+      if (map == MAP_FAILED)
+        written = false;
+      else
+        bytecode = static_cast<uint8_t *>(map);
+    }
+
+    const size_t chunks = layout.chunks.size();
+    std::vector<std::optional<Lexer::Token>> bounds(chunks), unknown(chunks);
+    pool.parallel_for(chunks,
+                      [&](size_t i)
+                      {
+                        const uint64_t end = i + 1 < chunks
+                                                 ? layout.chunks[i + 1].index
+                                                 : layout.instructions;
+                        encode(tree, layout.chunks[i], end, labels, bytecode,
+                               bounds[i], unknown[i]);
+                      });
+
+    if (bytecode)
+    {
+      write_be(bytecode + HEADER_START, layout.start, 8);
+      write_be(bytecode + HEADER_COUNT, layout.count, 8);
+      written = munmap(bytecode, layout.written) == 0;
+    }
+
+    // In the order assembling serially finds them: the layout stops at the
+    // first malformed instruction, but the only undefined labels it reports
+    // are those named by `global` and `noinline`, which come after any other
+    for (const auto &token : bounds)
+      if (token)
+        return error(ET::OPERAND_OUT_OF_BOUNDS, *token, arena);
+    if (err && err->type != ET::UNKNOWN_LABEL)
+      return err;
+    for (const auto &token : unknown)
+      if (token)
+        return error(ET::UNKNOWN_LABEL, *token, arena);
+    return err;
+  }
+
+  Err *parse(const std::vector<Unit> &units, const Preprocesser::Tree &tree,
+            Program &program, Arena &arena)
+  {
+    Leaves leaves{tree, {}, nullptr};
+    leaves.walk.emplace(tree, Slice<const Unit>{units.data(), units.size()});
+    Program_Output out{program, arena};
+    Labels labels;
+    program.instructions.clear();
+    program.noinline.clear();
+    program.depths.clear();
+    program.instructions.reserve(units.size() + tree.size());
+    return assemble(leaves, out, labels, arena);
+  }
+
+  void emit(const Program &program, std::vector<uint8_t> &bytecode)
+  {
+    Buffer_Output out{bytecode, HEADER_SIZE};
+    bytecode.resize(HEADER_SIZE +
+                    PARSER_BYTES_PER_UNIT * program.instructions.size());
+    for (const auto &instruction : program.instructions)
+      out.emit(instruction.opcode, instruction.operand,
+               effect(instruction.opcode).operand, *instruction.token);
+    out.header(program.start, program.instructions.size());
+    if (!program.depths.empty())
+    {
+      bytecode.resize(out.written + 8 * (1 + 2 * program.depths.size()));
+      out.patch(out.written, program.depths.size());
+      out.written += 8;
+      for (const auto &depth : program.depths)
+      {
+        out.patch(out.written, depth.routine);
+        out.patch(out.written + 8, depth.bytes);
+        out.written += 16;
+      }
+    }
+    bytecode.resize(out.written);
+  }
+
+  static std::array<Effect, 256> make_effects()
+  {
+    std::array<Effect, 256> table{};
+    // Bytes of each type of a family, in the order of its opcodes
+    const size_t unsigned_widths[] = {1, 4, 8};
+    const size_t signed_widths[]   = {1, 1, 4, 4, 8, 8};
+    for (size_t i = 0; i < 3; ++i)
+    {
+      const size_t w                  = unsigned_widths[i];
+      table[OP_PUSH_BYTE + i]          = {0, w, w, w, true};
+      table[OP_POP_BYTE + i]           = {w, 0, 0, w, true};
+      table[OP_PUSH_REGISTER_BYTE + i] = {0, w, 8, w, true};
+      table[OP_MOV_BYTE + i]           = {w, 0, 8, w, false};
+      table[OP_DUP_BYTE + i]           = {0, w, 8, w, true};
+      // Pops a count, pushing a pointer
+      table[OP_MALLOC_BYTE + i] = {8, 8, 0, w, false};
+      // Pops a pointer, an index and a value, or a pointer and an index
+      table[OP_MSET_BYTE + i] = {16 + w, 0, 0, w, false};
+      table[OP_MGET_BYTE + i] = {16, w, 0, w, false};
+      table[OP_NOT_BYTE + i]  = {w, w, 0, w, true};
+      table[OP_OR_BYTE + i]   = {2 * w, w, 0, w, true};
+      table[OP_AND_BYTE + i]  = {2 * w, w, 0, w, true};
+      table[OP_XOR_BYTE + i]  = {2 * w, w, 0, w, true};
+      // Comparisons push a byte
+      table[OP_EQ_BYTE + i]      = {2 * w, 1, 0, w, true};
+      table[OP_JUMP_IF_BYTE + i] = {w, 0, 8, w, false};
+    }
+    for (size_t i = 0; i < 6; ++i)
+    {
+      const size_t w          = signed_widths[i];
+      table[OP_LT_BYTE + i]    = {2 * w, 1, 0, w, true};
+      table[OP_LTE_BYTE + i]   = {2 * w, 1, 0, w, true};
+      table[OP_GT_BYTE + i]    = {2 * w, 1, 0, w, true};
+      table[OP_GTE_BYTE + i]   = {2 * w, 1, 0, w, true};
+      table[OP_PLUS_BYTE + i]  = {2 * w, w, 0, w, true};
+      table[OP_SUB_BYTE + i]   = {2 * w, w, 0, w, true};
+      table[OP_MULT_BYTE + i]  = {2 * w, w, 0, w, true};
+      table[OP_PRINT_BYTE + i] = {w, 0, 0, w, false};
+    }
+    table[OP_NOOP]       = {0, 0, 0, 0, true};
+    table[OP_HALT]       = {0, 0, 0, 0, false};
+    table[OP_MDELETE]    = {8, 0, 0, 0, false};
+    table[OP_MSIZE]      = {8, 8, 0, 0, false};
+    table[OP_JUMP_ABS]   = {0, 0, 8, 0, false};
+    table[OP_JUMP_STACK] = {8, 0, 0, 0, false};
+    table[OP_CALL]       = {0, 0, 8, 0, false};
+    table[OP_CALL_STACK] = {8, 0, 0, 0, false};
+    table[OP_RET]        = {0, 0, 0, 0, false};
+    return table;
+  }
+
+  const Effect &effect(uint8_t opcode)
+  {
+    static const std::array<Effect, 256> effects = make_effects();
+    return effects[opcode];
+  }
+
+  std::string to_string(const Err::Type &type)
+  {
+    switch (type)
+    {
+    case ET::EXPECTED_INSTRUCTION:
+      return "EXPECTED_INSTRUCTION";
+    case ET::EXPECTED_LITERAL:
+      return "EXPECTED_LITERAL";
+    case ET::EXPECTED_REGISTER:
+      return "EXPECTED_REGISTER";
+    case ET::EXPECTED_ADDRESS:
+      return "EXPECTED_ADDRESS";
+    case ET::EXPECTED_SYMBOL_FOR_GLOBAL:
+      return "EXPECTED_SYMBOL_FOR_GLOBAL";
+    case ET::OPERAND_OUT_OF_BOUNDS:
+      return "OPERAND_OUT_OF_BOUNDS";
+    case ET::DUPLICATE_LABEL:
+      return "DUPLICATE_LABEL";
+    case ET::UNKNOWN_LABEL:
+      return "UNKNOWN_LABEL";
+    case ET::EXPECTED_SYMBOL_FOR_NOINLINE:
+      return "EXPECTED_SYMBOL_FOR_NOINLINE";
+    }
+    return "";
+  }
+
+  std::string to_string(const Err &err)
+  {
+    std::stringstream ss;
+    const auto pos = err.token->position();
+    ss << pos.source_name << ":" << pos.line << ":" << pos.column << ": "
+       << to_string(err.type);
+    return ss.str();
+  }
+
+  std::ostream &operator<<(std::ostream &stream, const Err &err)
+  {
+    return stream << to_string(err);
+  }
+
+  Err::Err()
+  {
+  }
+
+  Err::Err(Err::Type type, Lexer::Token *token) : token{token}, type{type}
+  {
+  }
+} // namespace Parser
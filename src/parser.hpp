@@ -0,0 +1,166 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Parser and emitter of bytecode from preprocessed units
+ */
+
+#ifndef PARSER_HPP
+#define PARSER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <src/arena.hpp>
+#include <src/lexer.hpp>
+#include <src/preprocesser.hpp>
+#include <src/thread_pool.hpp>
+
+// Bytes of bytecode reserved up front per unit to assemble.  An instruction
+// is an opcode and at most a word of operand.
+#define PARSER_BYTES_PER_UNIT 9
+// Bytecode held before it's written out, when streaming to a file
+#define PARSER_BUFFER_SIZE (64 * 1024)
+// Instructions encoded per task when emitting in parallel
+#define PARSER_CHUNK_SIZE (64 * 1024)
+
+namespace Parser
+{
+  struct Err
+  {
+    Lexer::Token *token;
+    enum class Type
+    {
+      EXPECTED_INSTRUCTION,
+      EXPECTED_LITERAL,
+      EXPECTED_REGISTER,
+      EXPECTED_ADDRESS,
+      EXPECTED_SYMBOL_FOR_GLOBAL,
+      OPERAND_OUT_OF_BOUNDS,
+      DUPLICATE_LABEL,
+      UNKNOWN_LABEL,
+      EXPECTED_SYMBOL_FOR_NOINLINE,
+    } type;
+
+    Err();
+    Err(Err::Type, Lexer::Token *);
+  };
+
+  // Assemble the units produced by the preprocesser into bytecode for the
+  // AVM, written to `bytecode`:
+  //   - the start address (the label named by `global`, 0 without one)
+  //   - the number of instructions
+  //   - each instruction as its opcode followed by its operand, if any
+  // all big-endian, with addresses being indices of instructions.
+  //
+  // Units are assembled in one pass, emitting each instruction as it's
+  // parsed.  Labels referred to before their definition are left as fixups,
+  // patched once every label is known.  Errors are owned by `arena`.
+  Err *assemble(const std::vector<Preprocesser::Unit> &units,
+                const Preprocesser::Tree &tree, std::vector<uint8_t> &bytecode,
+                Arena &arena);
+
+  // Units to assemble a batch at a time, e.g. as they're preprocessed.
+  // `next` replaces `units` with the following batch, whose expansions are in
+  // `tree`, returning false once there are none left.  Tokens of a batch need
+  // only live until the next is asked for.
+  struct Batches
+  {
+    std::vector<Preprocesser::Unit> &units;
+    const Preprocesser::Tree &tree;
+    std::function<bool()> next;
+  };
+
+  // As above, but streaming bytecode to the file `fd` as it's assembled rather
+  // than building it in memory.  Only the current batch, a buffer of output
+  // and the labels and fixups are held, and fixups are patched in place with
+  // pwrite at the end, so `fd` must be seekable.  On an error the file is left
+  // incomplete.  `written` is set false if writing to `fd` failed.
+  Err *assemble(Batches &batches, int fd, bool &written, Arena &arena);
+
+  // As the first, but encoding straight into the file `fd`, mapped in memory,
+  // with chunks of PARSER_CHUNK_SIZE instructions encoded in parallel on
+  // `pool`.  A first pass defines labels and lays out the offset of each chunk
+  // from the opcodes and operand types of its instructions, so the file is
+  // sized exactly before any of it is encoded.  The bytecode, and any error,
+  // are those of the first.  `written` is set false if `fd` couldn't be sized
+  // or mapped.
+  Err *assemble(const std::vector<Preprocesser::Unit> &units,
+                const Preprocesser::Tree &tree, int fd, Thread_Pool &pool,
+                bool &written, Arena &arena);
+
+  // An instruction for the AVM
+  struct Instruction
+  {
+    uint8_t opcode;
+    // Literal, register or address, as the opcode takes.  Addresses are
+    // indices of instructions.
+    uint64_t operand;
+    // Token the instruction was parsed from, for reporting errors in it
+    Lexer::Token *token;
+  };
+
+  // Most bytes a routine has on the data stack above where it was on entry
+  struct Depth
+  {
+    uint64_t routine;
+    uint64_t bytes;
+  };
+
+  // Instructions with every label resolved, to be rewritten as a whole before
+  // they're emitted
+  struct Program
+  {
+    std::vector<Instruction> instructions;
+    // Address execution starts at
+    uint64_t start;
+    // Addresses of routines named by `noinline`, not to be inlined
+    std::vector<uint64_t> noinline;
+    // Depth of each routine, by address, once verified.  Left as they are by
+    // passes rewriting the instructions.
+    std::vector<Depth> depths;
+  };
+
+  // Parse units into `program`, with the same errors as assemble.
+  Err *parse(const std::vector<Preprocesser::Unit> &units,
+             const Preprocesser::Tree &tree, Program &program, Arena &arena);
+  // Bytecode of `program`, as assemble would have emitted it.  Any depths
+  // follow the instructions as their number then the address and depth of
+  // each, all big-endian words, which a VM may use to size its stack.
+  void emit(const Program &program, std::vector<uint8_t> &bytecode);
+
+  // What an opcode does to the data stack, as laid out in lib/inst.h
+  struct Effect
+  {
+    // Bytes popped from the data stack, then bytes pushed to it
+    size_t pops, pushes;
+    // Bytes of the operand following the opcode
+    size_t operand;
+    // Bytes of the type the opcode is for, 0 if untyped
+    size_t width;
+    // Whether the opcode does nothing but pop and push the data stack, so
+    // may be dropped if what it pushes is never used
+    bool pure;
+  };
+
+  // Effect of `opcode`, all zero for an unknown opcode
+  const Effect &effect(uint8_t opcode);
+
+  std::string to_string(const Err::Type &);
+  std::string to_string(const Err &);
+  std::ostream &operator<<(std::ostream &, const Err &);
+} // namespace Parser
+
+#endif
@@ -20,74 +20,256 @@
 
 #include <lib/base.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <iostream>
 #include <sstream>
 
+#include <sys/stat.h>
+
 namespace Preprocesser
 {
   using TT  = Lexer::Token::Type;
   using ET  = Err::Type;
   using LET = Lexer::Err::Type;
 
-  Err *preprocess(std::vector<Lexer::Token *> tokens, std::vector<Unit> &units,
-                  std::vector<Lexer::Token *> &new_token_bag, Map &const_map,
-                  Map &file_map, int depth)
+  // Pulls tokens from a slice as Lexer::Stream does from a file
+  struct Slice_Stream
+  {
+    Slice<Lexer::Token *> tokens;
+    size_t index;
+
+    Lexer::Token *next()
+    {
+      return index < tokens.size() ? tokens[index++] : nullptr;
+    }
+
+    Lexer::Token *peek()
+    {
+      return index < tokens.size() ? tokens[index] : nullptr;
+    }
+
+    size_t count() const
+    {
+      return index;
+    }
+
+    bool transient() const
+    {
+      return false;
+    }
+  };
+
+  static bool is_macro(const Block *block)
+  {
+    return block && block->root->type == TT::PP_MACRO;
+  }
+
+  // Tokens which may be passed to a macro: anything but a directive
+  static bool is_argument(const Lexer::Token *token)
+  {
+    return token && token->type != TT::PP_CONST &&
+           token->type != TT::PP_MACRO && token->type != TT::PP_USE &&
+           token->type != TT::PP_END && token->type != TT::PP_REFERENCE;
+  }
+
+  // Expand the reference `token`, with `arguments` if it calls a macro, at
+  // `depth` based on the latest definition of its name.  Bodies can't hold
+  // directives other than references, so the expansion of a constant is the
+  // same wherever it's referred to, as long as it fits below
+  // PREPROCESSER_MAX_DEPTH and the constants it reaches aren't redefined: it's
+  // expanded once and shared until then.  Expansions of macros depend on their
+  // arguments, so they're never shared, nor are those of constants which call
+  // a macro: `shared` is set false for them.
+  static Err *expand(Lexer::Token *token, Slice<Lexer::Token *> arguments,
+                     Range &units, bool &shared, Tree &tree, Arena &arena,
+                     Const_Map &const_map, int depth)
+  {
+    const Block *found = const_map.find(token->symbol);
+    if (!found)
+      return arena.make<Err>(ET::UNKNOWN_NAME_IN_REFERENCE, token);
+    const bool macro = is_macro(found);
+
+    // The body is expanded at depth + 1, each level of references below it one
+    // deeper
+    const Expansion *cached =
+        macro ? nullptr : const_map.expansion(token->symbol);
+    if (cached && depth + cached->height < PREPROCESSER_MAX_DEPTH)
+    {
+      units = cached->units;
+      return nullptr;
+    }
+
+    Slice<Lexer::Token *> body = found->body;
+    if (depth + 1 >= PREPROCESSER_MAX_DEPTH)
+      return arena.make<Err>(
+          ET::IN_ERROR, token,
+          arena.make<Err>(ET::EXCEEDED_PREPROCESSER_DEPTH, body[0]));
+
+    // Splice the arguments into the slots of the body
+    std::vector<Lexer::Token *> filled;
+    if (macro)
+    {
+      filled.resize(body.size());
+      for (size_t i = 0; i < body.size(); ++i)
+        filled[i] = found->slots[i] < 0 ? body[i] : arguments[found->slots[i]];
+      body = {filled.data(), filled.size()};
+    }
+
+    std::vector<Unit> expanded;
+    std::vector<uint32_t> references;
+    bool body_shared = true;
+    for (size_t i = 0; i < body.size(); ++i)
+    {
+      const auto child = body[i];
+      Range expansion{0, 0};
+      if (child->type == TT::PP_REFERENCE)
+      {
+        // Calls to macros take the tokens after them as arguments
+        const Block *callee = const_map.find(child->symbol);
+        const size_t count  = is_macro(callee) ? callee->parameters : 0;
+        for (size_t j = 1; j <= count; ++j)
+          if (i + j >= body.size() || !is_argument(body[i + j]))
+            return arena.make<Err>(
+                ET::IN_ERROR, token,
+                arena.make<Err>(ET::EXPECTED_ARGUMENT,
+                                i + j < body.size() ? body[i + j] : child));
+
+        Err *err = expand(child, {body.data() + i + 1, count}, expansion,
+                          body_shared, tree, arena, const_map, depth + 1);
+        if (err)
+          return arena.make<Err>(ET::IN_ERROR, token, err);
+        if (!is_macro(callee))
+          references.push_back(child->symbol);
+        i += count;
+      }
+      expanded.push_back(Unit{child, expansion});
+    }
+    units = tree.add(expanded, !macro && body_shared);
+    if (macro || !body_shared)
+      shared = false;
+    else
+      const_map.set_expansion(token->symbol, units, references);
+    return nullptr;
+  }
+
+  template <typename Stream>
+  static Err *preprocess_stream(Stream &tokens, std::vector<Unit> &units,
+                                Tree &tree, Arena &arena, Const_Map &const_map,
+                                Map &file_map, int depth, Includes *includes,
+                                Search_Path *search,
+                                size_t limit = SIZE_MAX)
   {
     // Stop preprocessing if we've smashed the preprocessing call stack
     if (depth >= PREPROCESSER_MAX_DEPTH)
-      return new Err{ET::EXCEEDED_PREPROCESSER_DEPTH, tokens[0]};
+    {
+      const auto token = tokens.peek();
+      return token ? arena.make<Err>(ET::EXCEEDED_PREPROCESSER_DEPTH, token)
+                   : nullptr;
+    }
 
-    for (size_t i = 0; i < tokens.size(); ++i)
+    std::vector<Lexer::Token *> body, parameters, arguments;
+    const auto expect = [&](TT type) -> Lexer::Token * {
+      const auto next = tokens.next();
+      return next && next->type == type ? next : nullptr;
+    };
+    for (Lexer::Token *token; units.size() < limit && (token = tokens.next());)
     {
-      const auto token = tokens[i];
-      if (token->type == TT::PP_CONST)
+      if (token->type == TT::PP_CONST || token->type == TT::PP_MACRO)
       {
-        if (i == tokens.size() - 1 || tokens[i + 1]->type != TT::SYMBOL)
-          return new Err{ET::EXPECTED_SYMBOL_FOR_NAME, token};
-        const auto const_name = tokens[i + 1]->content;
+        // %const name ... %end or %macro(name)(parameters...) ... %end
+        const bool macro   = token->type == TT::PP_MACRO;
+        Lexer::Token *name = nullptr;
+        if (!macro)
+          name = expect(TT::SYMBOL);
+        else if (expect(TT::LEFT_PAREN) && (name = expect(TT::SYMBOL)) &&
+                 !expect(TT::RIGHT_PAREN))
+          name = nullptr;
+        if (!name)
+          return arena.make<Err>(ET::EXPECTED_SYMBOL_FOR_NAME, token);
+        const auto id = name->symbol;
+
+        parameters.clear();
+        if (macro)
+        {
+          if (!expect(TT::LEFT_PAREN))
+            return arena.make<Err>(ET::EXPECTED_PARAMETERS, token);
+          Lexer::Token *parameter;
+          while ((parameter = tokens.next()) && parameter->type == TT::SYMBOL)
+          {
+            for (const auto other : parameters)
+              if (other->symbol == parameter->symbol)
+                return arena.make<Err>(ET::DUPLICATE_PARAMETER, parameter);
+            parameters.push_back(parameter);
+          }
+          if (!parameter || parameter->type != TT::RIGHT_PAREN)
+            return arena.make<Err>(ET::EXPECTED_PARAMETERS, token);
+        }
 
-        size_t end = 0;
-        for (end = i + 2;
-             end < tokens.size() && tokens[end]->type != TT::PP_END; ++end)
+        Lexer::Token *end = nullptr;
+        body.clear();
+        while ((end = tokens.next()) && end->type != TT::PP_END)
         {
           // TODO: Is there a better way to deal with preprocesser calls inside
           // of a constant?
-          if (tokens[end]->type == TT::PP_CONST ||
-              tokens[end]->type == TT::PP_USE)
-            return new Err{ET::DIRECTIVES_IN_CONST_BODY, tokens[end]};
+          if (end->type == TT::PP_CONST || end->type == TT::PP_MACRO ||
+              end->type == TT::PP_USE)
+            return arena.make<Err>(ET::DIRECTIVES_IN_CONST_BODY, end);
+          body.push_back(end);
         }
 
-        if (end == tokens.size())
-          return new Err{ET::EXPECTED_END, token};
-        else if (end - i == 2)
-          return new Err{ET::EMPTY_CONST, token};
+        if (!end)
+          return arena.make<Err>(ET::EXPECTED_END, token);
+        else if (body.empty())
+          return arena.make<Err>(ET::EMPTY_CONST, token);
 
         // Check if we're redefining a constant.  If the current depth is
         // equivalent or higher than the depth when the constant was defined,
         // then stop.
-        if (const_map.find(const_name) != const_map.end() &&
-            const_map[const_name].depth <= depth)
+        const Block *existing = const_map.find(id);
+        if (existing && existing->depth <= depth)
         {
-          i = end;
 #if VERBOSE >= 2
           INFO("PREPROCESSER",
                "<%d> [%lu]:\n\t Preserving definition of `%s` from outer "
                "scope\n",
-               depth, i, const_name.c_str());
+               depth, tokens.count() - 1,
+               std::string{Lexer::symbol_name(id)}.c_str());
 #endif
           continue;
         }
 
-        std::vector<Lexer::Token *> body{end - i - 2};
-        std::copy(std::begin(tokens) + i + 2, std::begin(tokens) + end,
-                  std::begin(body));
+        // Find the slot of every parameter in the body once, so calls are a
+        // splice of their arguments
+        Slice<int> slots;
+        if (macro)
+        {
+          slots = arena.make_slice<int>(body.size());
+          for (size_t j = 0; j < body.size(); ++j)
+          {
+            slots[j] = -1;
+            if (body[j]->type == TT::SYMBOL)
+              for (size_t k = 0; k < parameters.size(); ++k)
+                if (parameters[k]->symbol == body[j]->symbol)
+                  slots[j] = k;
+          }
+        }
 
-        const_map[const_name] = {token, body, depth};
-        i                     = end;
+        // Definitions outlive the tokens of a transient stream
+        if (tokens.transient())
+        {
+          token = arena.make<Lexer::Token>(*token);
+          for (auto &t : body)
+            t = arena.make<Lexer::Token>(*t);
+        }
+        const_map[id] = {token, arena.copy(body), depth, slots,
+                         static_cast<int>(parameters.size())};
 
 #if VERBOSE >= 2
-        INFO("PREPROCESSER", "<%d> [%lu]:\n\tConstant `%s` {\n", depth, i,
-             const_name.c_str());
+        INFO("PREPROCESSER", "<%d> [%lu]:\n\t%s `%s` {\n", depth,
+             tokens.count() - 1, macro ? "Macro" : "Constant",
+             std::string{Lexer::symbol_name(id)}.c_str());
 
         for (size_t j = 0; j < body.size(); ++j)
         {
@@ -96,6 +278,8 @@ namespace Preprocesser
             std::cout << *body[j];
           else
             std::cout << "[NULL]";
+          if (macro && slots[j] >= 0)
+            std::cout << " <- parameter " << slots[j];
           std::cout << "\n";
         }
         std::cout << "\t}\n";
@@ -103,94 +287,462 @@ namespace Preprocesser
       }
       else if (token->type == TT::PP_REFERENCE)
       {
-        // Reference expansion based on latest constant
-        const auto found = const_map.find(token->content);
-        if (found == const_map.end())
-          return new Err{ET::UNKNOWN_NAME_IN_REFERENCE, token};
-
-        std::vector<Unit> preprocessed;
-        Err *err = preprocess(found->second.body, preprocessed, new_token_bag,
-                              const_map, file_map, depth + 1);
+        // Calls to macros take the tokens after them as arguments
+        const Block *callee = const_map.find(token->symbol);
+        arguments.clear();
+        for (int i = 0; is_macro(callee) && i < callee->parameters; ++i)
+        {
+          const auto argument = tokens.next();
+          if (!is_argument(argument))
+            return arena.make<Err>(ET::EXPECTED_ARGUMENT,
+                                   argument ? argument : token);
+          arguments.push_back(argument);
+        }
+
+        Range expansion;
+        bool shared = true;
+        Err *err    = expand(token, {arguments.data(), arguments.size()},
+                             expansion, shared, tree, arena, const_map, depth);
         if (err)
-          return new Err{ET::IN_ERROR, token, err};
-        units.push_back(Unit{token, preprocessed});
+          return err;
+        units.push_back(Unit{token, expansion});
       }
       else if (token->type == TT::PP_USE)
       {
         // Ensure string in next token
-        if (i == tokens.size() - 1 || tokens[i + 1]->type != TT::LITERAL_STRING)
-          return new Err{ET::EXPECTED_FILE_NAME_AS_STRING, token};
+        const auto file_name = tokens.next();
+        if (!file_name || file_name->type != TT::LITERAL_STRING)
+          return arena.make<Err>(ET::EXPECTED_FILE_NAME_AS_STRING, token);
         // Stops recursive calls on the file currently being preprocessed
-        if (file_map.find(token->source_name) == file_map.end())
-          file_map[token->source_name] = {};
+        const auto &source_name = Lexer::get_file(token->file).name;
+        if (file_map.find(source_name) == file_map.end())
+          file_map[source_name] = {};
 
-        const auto name = tokens[i + 1]->content;
+        std::string name{file_name->content()};
 #if VERBOSE >= 2
-        INFO("PREPROCESSER", "<%d> [%lu]: (", depth, i);
-        std::cout << *tokens[i] << "): FILENAME=`" << name << "`\n";
+        INFO("PREPROCESSER", "<%d> [%lu]: (", depth, tokens.count() - 2);
+        std::cout << *token << "): FILENAME=`" << name << "`\n";
 #endif
-        // If file has never been encountered, let's tokenise, preprocess then
-        // cache the result
+        if (search)
+        {
+          const std::string *path = search->find(name);
+          if (!path)
+            return arena.make<Err>(ET::FILE_NON_EXISTENT, token);
+          name = *path;
+        }
+        // If file has never been encountered, let's stream it through the
+        // preprocesser
         if (file_map.find(name) == file_map.end())
         {
-          auto content = read_file(tokens[i + 1]->content.c_str());
-
-          if (!content.has_value())
-            return new Err{ET::FILE_NON_EXISTENT, token};
-
-          std::vector<Lexer::Token *> body;
-          Lexer::Err lexer_err = Lexer::tokenise_buffer(tokens[i + 1]->content,
-                                                        content.value(), body);
-
-          // Add tokens to the bag for deallocation later
-          // NOTE: We do this before errors so no memory leaks happen
-          new_token_bag.insert(std::end(new_token_bag), std::begin(body),
-                               std::end(body));
-
-          if (lexer_err.type != LET::OK)
-            return new Err{ET::IN_FILE_LEXING, token, nullptr, lexer_err};
-
-          file_map[name].body = body;
+          Includes::File loaded{false, false, 0, {}, {}};
+          if (includes)
+            loaded = includes->take(name, arena);
+          else
+          {
+            auto content     = read_file(name.c_str());
+            loaded.exists    = content.has_value();
+            loaded.too_large = !loaded.exists && errno == EFBIG;
+            if (loaded.exists)
+              loaded.file = Lexer::add_file(name, std::move(content.value()));
+          }
+
+          if (loaded.too_large)
+            return arena.make<Err>(ET::FILE_TOO_LARGE, token);
+          else if (!loaded.exists)
+            return arena.make<Err>(ET::FILE_NON_EXISTENT, token);
+
+          file_map[name]            = {};
+          Lexer::Stream body_tokens =
+              includes ? Lexer::Stream{loaded.file, arena,
+                                       std::move(loaded.tokens), loaded.err}
+                       : Lexer::Stream{loaded.file, arena};
           std::vector<Unit> body_units;
-          Err *err = preprocess(body, body_units, new_token_bag, const_map,
-                                file_map, depth + 1);
-          if (err)
-            return new Err{ET::IN_ERROR, token, err};
+          Err *err = preprocess(body_tokens, body_units, tree, arena,
+                                const_map, file_map, depth + 1, includes,
+                                search);
+          if (body_tokens.error().type != LET::OK)
+            return arena.make<Err>(ET::IN_FILE_LEXING, token, nullptr,
+                                   body_tokens.error());
+          else if (err)
+            return arena.make<Err>(ET::IN_ERROR, token, err);
 
           // Compile away empty bodies
           if (body_units.size() != 0)
-            units.push_back(Unit{token, body_units});
-          ++i;
+            units.push_back(Unit{token, tree.add(body_units, false)});
         }
         // Otherwise file must be part of the source tree already, so skip this
         // call
-        else
-          i += 1;
       }
       else if (token->type == TT::PP_END)
-        return new Err{ET::NO_CONST_AROUND, token};
+        return arena.make<Err>(ET::NO_CONST_AROUND, token);
       else
-        units.push_back(Unit{token, {}});
+        units.push_back(Unit{token, {0, 0}});
     }
     return nullptr;
   }
 
-  std::string to_string(const Unit &unit, int depth)
+  Err *preprocess(Slice<Lexer::Token *> tokens, std::vector<Unit> &units,
+                  Tree &tree, Arena &arena, Const_Map &const_map,
+                  Map &file_map, int depth, Includes *includes,
+                  Search_Path *search)
   {
-    std::stringstream ss;
-    for (int i = 0; i < depth; ++i)
-      ss << "\t";
-    ss << Lexer::to_string(*unit.root) << " => {";
-    if (unit.expansion.size() != 0)
+    Slice_Stream stream{tokens, 0};
+    return preprocess_stream(stream, units, tree, arena, const_map, file_map,
+                             depth, includes, search);
+  }
+
+  Err *preprocess(Lexer::Stream &tokens, std::vector<Unit> &units, Tree &tree,
+                  Arena &arena, Const_Map &const_map, Map &file_map,
+                  int depth, Includes *includes, Search_Path *search,
+                  size_t limit)
+  {
+    return preprocess_stream(tokens, units, tree, arena, const_map, file_map,
+                             depth, includes, search, limit);
+  }
+
+  void Search_Path::add(std::string directory)
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    directories.push_back(std::move(directory));
+  }
+
+  const std::string *Search_Path::find(const std::string &name)
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    const auto cached = names.find(name);
+    if (cached != names.end())
+      return cached->second;
+
+    const std::string *path = nullptr;
+    const size_t searched   = name[0] == '/' ? 0 : directories.size();
+    for (size_t i = 0; !path && i <= searched; ++i)
     {
-      ss << "\n";
-      for (auto child : unit.expansion)
-        ss << to_string(child, depth + 1) << "\n";
-      for (int i = 0; i < depth; ++i)
-        ss << "\t";
+      std::string candidate =
+          i == 0 ? name : directories[i - 1] + "/" + name;
+      struct stat st;
+      if (stat(candidate.c_str(), &st) != 0 || S_ISDIR(st.st_mode))
+        continue;
+      path = &files
+                  .insert({{static_cast<uint64_t>(st.st_dev),
+                            static_cast<uint64_t>(st.st_ino)},
+                           std::move(candidate)})
+                  .first->second;
     }
-    ss << "}";
-    return ss.str();
+    names[name] = path;
+    return path;
+  }
+
+  Includes::Includes(Thread_Pool &pool, Token_Cache *cache,
+                     Search_Path *search)
+      : pool{pool}, cache{cache}, search{search},
+        loads{std::make_shared<Loads>()}
+  {
+  }
+
+  Includes::~Includes()
+  {
+    // Loads not yet started are dropped, and those running refer to their
+    // entries so are waited on.  Only this object's loads are waited on, so
+    // it may be destroyed from a task.
+    std::unique_lock<std::mutex> lock{loads->mutex};
+    loads->queue.clear();
+    while (loads->running > 0)
+    {
+      loads->finished.wait(lock);
+      // Running loads may schedule those of the files they include
+      loads->queue.clear();
+    }
+  }
+
+  static bool is_space(char c)
+  {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  void Includes::load(uint16_t file)
+  {
+    // Scan the source for %use "name" without lexing it, so the files it
+    // includes start loading before the preprocesser reaches them.
+    const std::string_view source = Lexer::get_file(file).source;
+    for (size_t i = source.find('%'); i != std::string_view::npos;
+         i        = source.find('%', i + 1))
+    {
+      if (source.size() - i < 5 ||
+          !std::equal(source.begin() + i + 1, source.begin() + i + 4, "USE",
+                      [](char a, char b) { return toupper(a) == b; }) ||
+          !is_space(source[i + 4]))
+        continue;
+      size_t begin = i + 4;
+      while (begin < source.size() && is_space(source[begin]))
+        ++begin;
+      if (begin == source.size() || source[begin] != '\"')
+        continue;
+      const size_t end = source.find('\"', begin + 1);
+      if (end == std::string_view::npos)
+        break;
+      schedule(std::string{source.substr(begin + 1, end - begin - 1)});
+      i = end;
+    }
+  }
+
+  Includes::File Includes::take(const std::string &name, Arena &arena)
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    auto &slot = entries[name];
+    if (!slot)
+    {
+      slot         = std::make_unique<Entry>();
+      Entry *entry = slot.get();
+      lock.unlock();
+      fetch(name, *entry);
+      lock.lock();
+    }
+    else if (!slot->ready && claim(slot.get()))
+    {
+      // No task has started it, so load it here rather than wait for one
+      Entry *entry = slot.get();
+      lock.unlock();
+      fetch(name, *entry);
+      lock.lock();
+    }
+    Entry &entry = *slot;
+    loaded.wait(lock, [&]() { return entry.ready; });
+    File file = std::move(entry.file);
+    arena.adopt(entry.arena);
+    return file;
+  }
+
+  void Includes::schedule(std::string name)
+  {
+    if (search)
+    {
+      const std::string *path = search->find(name);
+      if (!path)
+        return;
+      name = *path;
+    }
+    Entry *entry;
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      auto &slot = entries[name];
+      if (slot)
+        return;
+      slot  = std::make_unique<Entry>();
+      entry = slot.get();
+    }
+    {
+      std::lock_guard<std::mutex> lock{loads->mutex};
+      loads->queue.push_back({std::move(name), entry});
+    }
+    pool.submit(
+        [this, loads = loads]()
+        {
+          std::unique_lock<std::mutex> lock{loads->mutex};
+          if (loads->queue.empty())
+            return;
+          auto [name, entry] = std::move(loads->queue.front());
+          loads->queue.pop_front();
+          ++loads->running;
+          lock.unlock();
+          fetch(name, *entry);
+          lock.lock();
+          if (--loads->running == 0)
+            loads->finished.notify_all();
+        });
+  }
+
+  // Take `entry` off the queue if no task has started loading it
+  bool Includes::claim(const Entry *entry)
+  {
+    std::lock_guard<std::mutex> lock{loads->mutex};
+    for (auto it = loads->queue.begin(); it != loads->queue.end(); ++it)
+      if (it->second == entry)
+      {
+        loads->queue.erase(it);
+        return true;
+      }
+    return false;
+  }
+
+  void Includes::fetch(std::string name, Entry &entry)
+  {
+    // A file's %use's are scheduled before it's marked ready, so they're known
+    // by the time the preprocesser reaches them.  Without threads they'd be
+    // loaded right here, so they're left to take.
+    auto content = read_file(name.c_str());
+    File file{content.has_value(), false, 0, {}, {}};
+    file.too_large = !file.exists && errno == EFBIG;
+    if (file.exists)
+    {
+      file.file = Lexer::add_file(name, std::move(content.value()));
+      file.err  = cache
+                      ? cache->tokenise(file.file, file.tokens, entry.arena)
+                      : Lexer::tokenise_buffer(file.file, file.tokens,
+                                               entry.arena, pool);
+      for (size_t i = 0; pool.size() > 0 && i + 1 < file.tokens.size(); ++i)
+        if (file.tokens[i]->type == TT::PP_USE &&
+            file.tokens[i + 1]->type == TT::LITERAL_STRING)
+          schedule(std::string{file.tokens[i + 1]->content()});
+    }
+
+    std::lock_guard<std::mutex> lock{mutex};
+    entry.file  = std::move(file);
+    entry.ready = true;
+    loaded.notify_all();
+  }
+
+  // Ranges of transient expansions are marked by the top bit of their first
+  // unit
+  static constexpr uint32_t TRANSIENT = UINT32_C(1) << 31;
+
+  Range Tree::add(const std::vector<Unit> &expansion, bool shared)
+  {
+    auto &array = shared ? units : transient;
+    Range range{static_cast<uint32_t>(array.size()) | (shared ? 0 : TRANSIENT),
+                static_cast<uint32_t>(expansion.size())};
+    array.insert(array.end(), expansion.begin(), expansion.end());
+    return range;
+  }
+
+  Slice<const Unit> Tree::expansion(const Unit &unit) const
+  {
+    const uint32_t first = unit.expansion.first;
+    if (first & TRANSIENT)
+      return {transient.data() + (first & ~TRANSIENT), unit.expansion.size};
+    return {units.data() + first, unit.expansion.size};
+  }
+
+  size_t Tree::size() const
+  {
+    return units.size() + transient.size();
+  }
+
+  void Tree::release()
+  {
+    transient.clear();
+  }
+
+  void Tree::clear()
+  {
+    units.clear();
+    transient.clear();
+  }
+
+  Walk::Walk(const Tree &tree, Slice<const Unit> units) : tree{tree}, top{0}
+  {
+    stack[0] = units;
+  }
+
+  const Unit *Walk::next(int &depth)
+  {
+    while (top >= 0 && stack[top].size() == 0)
+      --top;
+    if (top < 0)
+      return nullptr;
+    auto &frame       = stack[top];
+    const Unit *unit  = frame.begin();
+    frame             = {frame.begin() + 1, frame.size() - 1};
+    depth             = top;
+    if (unit->expansion.size != 0)
+      stack[++top] = tree.expansion(*unit);
+    return unit;
+  }
+
+  Block *Const_Map::find(uint32_t id)
+  {
+    return id < entries.size() && entries[id].block.root ? &entries[id].block
+                                                         : nullptr;
+  }
+
+  Block &Const_Map::operator[](uint32_t id)
+  {
+    if (id >= entries.size())
+      entries.resize(id + 1, Entry{{nullptr, {}, 0, {}, 0}, 0, false, {}, {}});
+    auto &entry    = entries[id];
+    entry.version  = ++versions;
+    entry.expanded = false;
+    entry.reaches.clear();
+    return entry.block;
+  }
+
+  void Const_Map::erase(uint32_t id)
+  {
+    if (id < entries.size())
+      operator[](id) = {nullptr, {}, 0, {}, 0};
+  }
+
+  size_t Const_Map::size() const
+  {
+    return entries.size();
+  }
+
+  void Const_Map::clear()
+  {
+    entries.clear();
+  }
+
+  const Expansion *Const_Map::expansion(uint32_t id) const
+  {
+    if (id >= entries.size() || !entries[id].expanded)
+      return nullptr;
+    const auto &entry = entries[id];
+    for (const auto &[reached, version] : entry.reaches)
+      if (entries[reached].version != version)
+        return nullptr;
+    return &entry.expansion;
+  }
+
+  void Const_Map::set_expansion(uint32_t id, Range units,
+                                const std::vector<uint32_t> &references)
+  {
+    auto &entry = entries[id];
+    int height  = 0;
+    entry.reaches.clear();
+    for (const auto reference : references)
+    {
+      const auto &child = entries[reference];
+      height            = std::max(height, child.expansion.height);
+      entry.reaches.push_back({reference, child.version});
+      entry.reaches.insert(entry.reaches.end(), child.reaches.begin(),
+                           child.reaches.end());
+    }
+    std::sort(entry.reaches.begin(), entry.reaches.end());
+    entry.reaches.erase(std::unique(entry.reaches.begin(), entry.reaches.end()),
+                        entry.reaches.end());
+    entry.expansion = {units, height + 1};
+    entry.expanded  = true;
+  }
+
+  std::string to_string(const Unit &unit, const Tree &tree, int depth)
+  {
+    // Units with an expansion are closed once the walk leaves it: those at
+    // depths [0, open) are still open.
+    std::string str;
+    int open        = 0;
+    const auto close = [&](int level) {
+      str.append(depth + level, '\t');
+      str += level > 0 ? "}\n" : "}";
+    };
+
+    Walk walk{tree, {&unit, 1}};
+    int level;
+    while (const Unit *u = walk.next(level))
+    {
+      for (; open > level; --open)
+        close(open - 1);
+      str.append(depth + level, '\t');
+      str += Lexer::to_string(*u->root);
+      if (u->expansion.size != 0)
+      {
+        str += " => {\n";
+        open = level + 1;
+      }
+      else
+        str += level > 0 ? " => {}\n" : " => {}";
+    }
+    for (; open > 0; --open)
+      close(open - 1);
+    return str;
   }
 
   std::string to_string(const Err::Type &type)
@@ -221,6 +773,14 @@ namespace Preprocesser
       return "IN_ERROR";
     case ET::EXCEEDED_PREPROCESSER_DEPTH:
       return "EXCEEDED_PREPROCESSER_DEPTH";
+    case ET::EXPECTED_PARAMETERS:
+      return "EXPECTED_PARAMETERS";
+    case ET::DUPLICATE_PARAMETER:
+      return "DUPLICATE_PARAMETER";
+    case ET::EXPECTED_ARGUMENT:
+      return "EXPECTED_ARGUMENT";
+    case ET::FILE_TOO_LARGE:
+      return "FILE_TOO_LARGE";
     default:
       return "";
     }
@@ -237,8 +797,9 @@ namespace Preprocesser
     for (size_t depth = 0; depth < errors.size(); ++depth)
     {
       const Err &e = *errors[depth];
-      ss << e.token->source_name << ":" << e.token->line << ":"
-         << e.token->column << ": " << to_string(e.type);
+      const auto pos = e.token->position();
+      ss << pos.source_name << ":" << pos.line << ":" << pos.column << ": "
+         << to_string(e.type);
       if (e.type == ET::IN_FILE_LEXING)
         ss << ":\n" << e.lexer_error;
       if (depth != errors.size() - 1)
@@ -247,11 +808,6 @@ namespace Preprocesser
     return ss.str();
   }
 
-  std::ostream &operator<<(std::ostream &stream, const Unit &unit)
-  {
-    return stream << to_string(unit, 1);
-  }
-
   std::ostream &operator<<(std::ostream &stream, const Err &err)
   {
     return stream << to_string(err);
@@ -266,10 +822,4 @@ namespace Preprocesser
   {
   }
 
-  Err::~Err(void)
-  {
-    if (this->child_error)
-      delete this->child_error;
-  }
-
 } // namespace Preprocesser
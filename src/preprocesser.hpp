@@ -17,27 +17,136 @@
 #ifndef PREPROCESSER_HPP
 #define PREPROCESSER_HPP
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include <src/arena.hpp>
+#include <src/cache.hpp>
 #include <src/lexer.hpp>
+#include <src/thread_pool.hpp>
 
 namespace Preprocesser
 {
 #define PREPROCESSER_MAX_DEPTH 16
+  // The definition of a constant or macro.  A macro's body is analysed once
+  // when defined: each token is either a slot for a parameter or copied into
+  // every call as is, so a call is a splice of its arguments into the slots.
   struct Block
   {
     Lexer::Token *root;
-    std::vector<Lexer::Token *> body;
+    Slice<Lexer::Token *> body;
     int depth;
+    // Macros only: the parameter each token of the body is a slot for, or -1
+    Slice<int> slots;
+    int parameters;
   };
 
   typedef std::unordered_map<std::string, Block> Map;
 
+  // Units [first, first + size) of a Tree
+  struct Range
+  {
+    uint32_t first, size;
+  };
+
   struct Unit
   {
-    Lexer::Token *const root;
-    std::vector<Unit> expansion;
+    Lexer::Token *root;
+    Range expansion;
+  };
+
+  // Expansions of every unit, flattened into arrays.  A unit's expansion is a
+  // range of an array holding its children; children are added before their
+  // parent so each expansion is contiguous.  An expansion used in many places,
+  // such as a constant referred to repeatedly, is stored once and shared.
+  // Expansions used in one place only (macro calls, %use and anything holding
+  // those) are transient: they're kept apart from shared ones, so that once
+  // their units are done with they may be dropped by release().
+  struct Tree
+  {
+    // Shared expansions
+    std::vector<Unit> units;
+    std::vector<Unit> transient;
+
+    // Append `expansion` as a contiguous range.  Shared expansions may only
+    // hold units whose expansions are shared too.
+    Range add(const std::vector<Unit> &expansion, bool shared = true);
+    Slice<const Unit> expansion(const Unit &unit) const;
+    // Units held across both arrays
+    size_t size() const;
+    // Drop every transient expansion
+    void release();
+    void clear();
+  };
+
+  // Pre-order walk over units and their expansions, without recursion or
+  // allocation.
+  struct Walk
+  {
+    Walk(const Tree &tree, Slice<const Unit> units);
+
+    // Next unit, setting `depth` to its depth below the units walked, or
+    // nullptr at the end
+    const Unit *next(int &depth);
+
+  private:
+    const Tree &tree;
+    // Expansions nest at most PREPROCESSER_MAX_DEPTH deep
+    Slice<const Unit> stack[PREPROCESSER_MAX_DEPTH + 1];
+    int top;
+  };
+
+  // The body of a constant with every reference in it expanded
+  struct Expansion
+  {
+    Range units;
+    // Levels of bodies expanded, 1 if the body has no references
+    int height;
+  };
+
+  // Constants and macros indexed by the symbol ID of their name (see
+  // Lexer::intern).  Undefined constants have no root.
+  struct Const_Map
+  {
+    // nullptr if `id` isn't defined
+    Block *find(uint32_t id);
+    // Any access through here counts as a redefinition of `id`.
+    Block &operator[](uint32_t id);
+    void erase(uint32_t id);
+    // IDs of defined constants are below this
+    size_t size() const;
+    void clear();
+
+    // Expansion of `id` recorded by set_expansion, or nullptr if `id` or a
+    // constant it reaches has been (re)defined since.
+    const Expansion *expansion(uint32_t id) const;
+    // Record the expansion of `id`, whose body refers to the constants
+    // `references`, each of which must have an expansion recorded.
+    void set_expansion(uint32_t id, Range units,
+                       const std::vector<uint32_t> &references);
+
+  private:
+    struct Entry
+    {
+      Block block;
+      // Bumped on every redefinition
+      uint32_t version;
+      bool expanded;
+      Expansion expansion;
+      // Constants reached by the expansion, and their versions at the time
+      std::vector<std::pair<uint32_t, uint32_t>> reaches;
+    };
+    std::vector<Entry> entries;
+    uint32_t versions = 0;
   };
 
   struct Err
@@ -61,21 +170,125 @@ namespace Preprocesser
 
       IN_ERROR,
       EXCEEDED_PREPROCESSER_DEPTH,
+
+      EXPECTED_PARAMETERS,
+      DUPLICATE_PARAMETER,
+      EXPECTED_ARGUMENT,
+
+      FILE_TOO_LARGE,
     } type;
 
     Err();
     Err(Err::Type, Lexer::Token *, Err *child = nullptr, Lexer::Err err = {});
-    ~Err(void);
   };
 
-  Err *preprocess(std::vector<Lexer::Token *> tokens, std::vector<Unit> &units,
-                  std::vector<Lexer::Token *> &new_token_bag, Map &const_map,
-                  Map &file_map, int depth = 0);
+  // Where %use looks for files: the working directory, then each directory
+  // added in order.  A file is named by the first path it was found at, so the
+  // same file reached by different names (e.g. "lib/io.asm" and
+  // "./lib/io.asm") is identified by its device and inode and only included
+  // once.  Lookups are cached by name, so repeated %use's don't stat again.
+  // May be used from any thread.
+  struct Search_Path
+  {
+    void add(std::string directory);
+    // Path of the file `name` refers to, or nullptr if there's no such file.
+    // Absolute names aren't searched for.
+    const std::string *find(const std::string &name);
+
+  private:
+    std::vector<std::string> directories;
+    std::mutex mutex;
+    std::unordered_map<std::string, const std::string *> names;
+    std::map<std::pair<uint64_t, uint64_t>, std::string> files;
+  };
+
+  // Included files read and lexed ahead of preprocessing.  The %use graph is
+  // discovered by scanning each file for %use's as it's loaded, and every
+  // reachable file is read and lexed concurrently on a thread pool.  The
+  // preprocesser still takes files in declaration order, so shadowing of
+  // constants and repeated %use's behave as if each were read on reaching its
+  // %use.  The scan may find files which are never used (e.g. a %use in a
+  // comment), which are just dropped, and a file it misses is loaded when the
+  // preprocesser takes it.  With a cache, files are lexed through it.  With a
+  // search path, files are named by their path as the preprocesser does.
+  struct Includes
+  {
+    struct File
+    {
+      bool exists;
+      // Whether it exists but is larger than SOURCE_MAX_SIZE
+      bool too_large;
+      uint16_t file;
+      std::vector<Lexer::Token *> tokens;
+      Lexer::Err err;
+    };
+
+    Includes(Thread_Pool &pool, Token_Cache *cache = nullptr,
+             Search_Path *search = nullptr);
+    ~Includes();
+    Includes(const Includes &)            = delete;
+    Includes &operator=(const Includes &) = delete;
+
+    // Start loading every file included from `file`, which isn't lexed here.
+    void load(uint16_t file);
+    // Wait for `name` to be loaded, moving its tokens into `arena`.  Loads
+    // `name` on the caller if it wasn't found by the scan.
+    File take(const std::string &name, Arena &arena);
+
+  private:
+    struct Entry
+    {
+      bool ready;
+      File file;
+      Arena arena;
+    };
+
+    // Loads scheduled on the pool, which its tasks take in turn.  Tasks share
+    // them with the object, so those run after it's gone find none to take.
+    struct Loads
+    {
+      std::mutex mutex;
+      std::condition_variable finished;
+      std::deque<std::pair<std::string, Entry *>> queue;
+      size_t running = 0;
+    };
+
+    Thread_Pool &pool;
+    Token_Cache *cache;
+    Search_Path *search;
+    std::mutex mutex;
+    std::condition_variable loaded;
+    std::unordered_map<std::string, std::unique_ptr<Entry>> entries;
+    std::shared_ptr<Loads> loads;
+
+    void schedule(std::string name);
+    bool claim(const Entry *entry);
+    void fetch(std::string name, Entry &entry);
+  };
+
+  // Top level units are appended to `units`, their expansions to `tree`.  All
+  // tokens and errors created while preprocessing are owned by `arena`.
+  // Included files are streamed, so `file_map` only records which files have
+  // been seen.  Files already loaded by `includes` are taken from it.  Without
+  // a search path, files are named by the string given to %use.
+  Err *preprocess(Slice<Lexer::Token *> tokens, std::vector<Unit> &units,
+                  Tree &tree, Arena &arena, Const_Map &const_map,
+                  Map &file_map, int depth = 0, Includes *includes = nullptr,
+                  Search_Path *search = nullptr);
+  // Preprocess tokens as they're pulled from `tokens`, stopping at the first
+  // error.  Errors in lexing end the stream: check tokens.error() first.
+  // Stops early once `units` holds `limit` units; calling again with the same
+  // stream and maps carries on from there, so a file may be preprocessed a
+  // batch at a time.  Definitions taken from a transient stream are copied
+  // into `arena`.
+  Err *preprocess(Lexer::Stream &tokens, std::vector<Unit> &units, Tree &tree,
+                  Arena &arena, Const_Map &const_map, Map &file_map,
+                  int depth = 0, Includes *includes = nullptr,
+                  Search_Path *search = nullptr, size_t limit = SIZE_MAX);
 
-  std::string to_string(const Unit &, int depth = 0);
+  std::string to_string(const Unit &, const Tree &, int depth = 0);
   std::string to_string(const Err::Type &);
   std::string to_string(const Err &);
-  std::ostream &operator<<(std::ostream &, const Unit &);
   std::ostream &operator<<(std::ostream &, const Err &);
 }; // namespace Preprocesser
 #endif
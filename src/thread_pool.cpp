@@ -0,0 +1,124 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Fixed size pool of worker threads
+ */
+
+#include <src/thread_pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+Thread_Pool::Thread_Pool(size_t threads) : running{0}, stopping{false}
+{
+  for (size_t i = 0; i < threads; ++i)
+    workers.emplace_back([this]() { work(); });
+}
+
+Thread_Pool::~Thread_Pool()
+{
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    stopping = true;
+  }
+  task_ready.notify_all();
+  for (auto &worker : workers)
+    worker.join();
+}
+
+size_t Thread_Pool::size() const
+{
+  return workers.size();
+}
+
+void Thread_Pool::submit(std::function<void()> task)
+{
+  if (workers.empty())
+  {
+    task();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    tasks.push_back(std::move(task));
+  }
+  task_ready.notify_one();
+}
+
+void Thread_Pool::wait()
+{
+  std::unique_lock<std::mutex> lock{mutex};
+  all_done.wait(lock, [this]() { return tasks.empty() && running == 0; });
+}
+
+void Thread_Pool::work()
+{
+  while (true)
+  {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      task_ready.wait(lock, [this]() { return stopping || !tasks.empty(); });
+      if (tasks.empty())
+        return;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+      ++running;
+    }
+
+    task();
+
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      --running;
+      if (tasks.empty() && running == 0)
+        all_done.notify_all();
+    }
+  }
+}
+
+void Thread_Pool::run(size_t n, const std::function<void(size_t)> &fn)
+{
+  // Indices are claimed by the caller as well as by the tasks, so they're all
+  // run even if no worker is free to take a task, e.g. when every worker is
+  // itself in a parallel_for.  Tasks may start after the caller returns,
+  // finding nothing left to claim, so they share the batch.
+  struct Batch
+  {
+    std::atomic<size_t> next{0};
+    size_t done = 0;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+  auto batch = std::make_shared<Batch>();
+  auto claim = [batch, &fn, n]()
+  {
+    size_t ran = 0;
+    for (size_t i; (i = batch->next++) < n; ++ran)
+      fn(i);
+    if (ran == 0)
+      return;
+    std::lock_guard<std::mutex> lock{batch->mutex};
+    batch->done += ran;
+    if (batch->done == n)
+      batch->finished.notify_all();
+  };
+
+  for (size_t i = 0; i + 1 < std::min(n, workers.size() + 1); ++i)
+    submit(claim);
+  claim();
+
+  std::unique_lock<std::mutex> lock{batch->mutex};
+  batch->finished.wait(lock, [&]() { return batch->done == n; });
+}
@@ -0,0 +1,61 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-16
+ * Author: Aryadev Chavali
+ * Description: Fixed size pool of worker threads
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Thread_Pool
+{
+  // A pool of 0 threads runs every task on the caller, in submit.
+  Thread_Pool(size_t threads);
+  ~Thread_Pool();
+  Thread_Pool(const Thread_Pool &)            = delete;
+  Thread_Pool &operator=(const Thread_Pool &) = delete;
+
+  size_t size() const;
+  void submit(std::function<void()> task);
+  // Block until every submitted task has finished.
+  void wait();
+
+  // Run fn(0) ... fn(n - 1) on the pool and the caller, returning when all
+  // are done.  Only waits on its own calls, so it may be used from a task.
+  template <typename F>
+  void parallel_for(size_t n, F fn)
+  {
+    run(n, std::function<void(size_t)>{fn});
+  }
+
+private:
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable task_ready, all_done;
+  size_t running;
+  bool stopping;
+
+  void work();
+  void run(size_t n, const std::function<void(size_t)> &fn);
+};
+
+#endif
@@ -0,0 +1,366 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-17
+ * Author: Aryadev Chavali
+ * Description: Static checks of the data stack of parsed programs
+ */
+
+extern "C"
+{
+#include <lib/inst.h>
+}
+
+#include <src/verifier.hpp>
+
+#include <algorithm>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Verifier
+{
+  using Parser::Instruction, Parser::Program, Parser::effect;
+  using ET = Err::Type;
+
+  // The data stack as a routine sees it, by the widths of its values
+  struct Stack
+  {
+    // Values of its callers the routine has taken from below its entry,
+    // nearest first
+    std::vector<uint8_t> taken;
+    // Values from the lowest the routine has taken the stack to, bottom first
+    std::vector<uint8_t> values;
+
+    // Bytes above the entry of the routine
+    int64_t height() const
+    {
+      int64_t bytes = 0;
+      for (const auto width : values)
+        bytes += width;
+      for (const auto width : taken)
+        bytes -= width;
+      return bytes;
+    }
+
+    // Take values of the widths in `other` past those already taken, leaving
+    // them on the stack
+    void lift(const std::vector<uint8_t> &other)
+    {
+      for (size_t i = taken.size(); i < other.size(); ++i)
+      {
+        taken.push_back(other[i]);
+        values.insert(values.begin(), other[i]);
+      }
+    }
+  };
+
+  // The start of the program, or an address called
+  struct Routine
+  {
+    uint64_t address;
+    // Stack on reaching each instruction
+    std::unordered_map<uint64_t, Stack> stacks;
+    // Stack on returning, once the routine has
+    std::optional<Stack> exit;
+    // Most values taken from its callers on any path, returning or not
+    std::vector<uint8_t> taken;
+    // Calls of the routine, as the routine and address of each
+    std::vector<std::pair<size_t, uint64_t>> calls;
+    int64_t depth;
+  };
+
+  // Widths of the values `op` pops, top first, and of the value it pushes, 0
+  // if it pushes none
+  static void values(uint8_t op, std::vector<uint8_t> &pops, uint8_t &push)
+  {
+    const auto &e       = effect(op);
+    const uint8_t width = e.width;
+    push                = e.pushes;
+    if (op >= OP_MSET_BYTE && op <= OP_MSET_WORD)
+      // An index, the value, then the pointer
+      pops = {8, width, 8};
+    else if (op >= OP_MGET_BYTE && op <= OP_MGET_WORD)
+      pops = {8, 8};
+    else if ((op >= OP_MALLOC_BYTE && op <= OP_MALLOC_WORD) ||
+             op == OP_MSIZE || op == OP_MDELETE)
+      pops.assign(e.pops / 8, 8);
+    else
+      pops.assign(width ? e.pops / width : 0, width);
+  }
+
+  // Stacks of each routine, found by following every instruction reached
+  // until none change
+  struct Checker
+  {
+    const Program &program;
+    Arena &arena;
+    std::vector<Routine> routines;
+    std::unordered_map<uint64_t, size_t> addresses;
+    // Instructions to follow, as the routine and address of each
+    std::vector<std::pair<size_t, uint64_t>> work;
+    // Instruction being followed
+    uint64_t current = 0;
+    Err *err         = nullptr;
+
+    bool fail(ET type, uint64_t address)
+    {
+      // Addresses past the end are reached from the instruction being
+      // followed, which is the one at fault
+      const auto &instructions = program.instructions;
+      const uint64_t at = address < instructions.size() ? address : current;
+      err = arena.make<Err>(type, address, instructions[at].token);
+      return false;
+    }
+
+    // Routine at `address`, checking it from an empty stack if it's new
+    size_t routine(uint64_t address)
+    {
+      const auto [it, added] = addresses.emplace(address, routines.size());
+      if (added)
+      {
+        routines.push_back({address, {}, std::nullopt, {}, {}, 0});
+        reach(it->second, address, {});
+      }
+      return it->second;
+    }
+
+    // Merge `from` into `into`, setting `changed` if `into` took more of the
+    // stack to agree with it
+    bool merge(Stack &into, Stack from, uint64_t address, bool &changed)
+    {
+      changed = from.taken.size() > into.taken.size();
+      into.lift(from.taken);
+      from.lift(into.taken);
+      if (into.taken != from.taken || into.values != from.values)
+        return fail(ET::INCONSISTENT_STACK, address);
+      return true;
+    }
+
+    // Note routine `r` takes what `stack` has at `address`, which callers must
+    // have pushed whether or not it returns
+    bool take(size_t r, const Stack &stack, uint64_t address)
+    {
+      Routine &routine = routines[r];
+      const size_t common =
+          std::min(routine.taken.size(), stack.taken.size());
+      if (!std::equal(stack.taken.begin(), stack.taken.begin() + common,
+                      routine.taken.begin()))
+        return fail(ET::WIDTH_MISMATCH, address);
+      // Taking more than the program has instructions to push can only be
+      // recursion taking values without end
+      else if (stack.taken.size() > program.instructions.size())
+        return fail(ET::STACK_UNDERFLOW, address);
+      else if (stack.taken.size() > routine.taken.size())
+      {
+        routine.taken = stack.taken;
+        for (const auto &call : routine.calls)
+          work.push_back(call);
+      }
+      return true;
+    }
+
+    // Reach `address` in routine `r` with `stack`
+    bool reach(size_t r, uint64_t address, const Stack &stack)
+    {
+      if (!take(r, stack, address))
+        return false;
+      Routine &routine = routines[r];
+      routine.depth    = std::max(routine.depth, stack.height());
+      // Running off the end of the program stops it
+      if (address >= program.instructions.size())
+        return true;
+      const auto [it, added] = routine.stacks.emplace(address, stack);
+      bool changed           = added;
+      if (!added && !merge(it->second, stack, address, changed))
+        return false;
+      if (changed)
+        work.push_back({r, address});
+      return true;
+    }
+
+    // Take a value of `width` bytes off `stack` at `address` in routine `r`.
+    // Only routines called may take values pushed before their entry.
+    bool pop(Stack &stack, size_t r, uint8_t width, uint64_t address)
+    {
+      if (stack.values.empty())
+      {
+        if (r == 0)
+          return fail(ET::STACK_UNDERFLOW, address);
+        stack.taken.push_back(width);
+      }
+      else if (stack.values.back() != width)
+        return fail(ET::WIDTH_MISMATCH, address);
+      else
+        stack.values.pop_back();
+      return true;
+    }
+
+    bool ret(size_t r, uint64_t address, const Stack &stack)
+    {
+      Routine &routine = routines[r];
+      bool changed     = !routine.exit;
+      if (!routine.exit)
+        routine.exit = stack;
+      else if (!merge(*routine.exit, stack, address, changed))
+        return false;
+      // Calls carry on with what the routine now returns
+      if (changed)
+        for (const auto &call : routine.calls)
+          work.push_back(call);
+      return true;
+    }
+
+    bool call(size_t r, uint64_t address, Stack stack)
+    {
+      const size_t callee = routine(program.instructions[address].operand);
+      auto &calls         = routines[callee].calls;
+      if (std::find(calls.begin(), calls.end(), std::pair{r, address}) ==
+          calls.end())
+        calls.push_back({r, address});
+      // Whatever the routine takes must be there, and it's followed once it
+      // returns
+      Stack taking = stack;
+      for (const auto width : routines[callee].taken)
+        if (!pop(taking, r, width, address))
+          return false;
+      if (!take(r, taking, address))
+        return false;
+      else if (!routines[callee].exit)
+        return true;
+      const Stack exit = *routines[callee].exit;
+      for (const auto width : exit.taken)
+        if (!pop(stack, r, width, address))
+          return false;
+      stack.values.insert(stack.values.end(), exit.values.begin(),
+                          exit.values.end());
+      return reach(r, address + 1, stack);
+    }
+
+    // dup.T n copies the nth value down, so the n values above it must be as
+    // wide as it
+    bool dup(Stack &stack, size_t r, uint8_t width, uint64_t address)
+    {
+      const uint64_t n = program.instructions[address].operand;
+      if (n >= stack.values.size())
+      {
+        // Nothing reaches deeper than the program has instructions to push
+        if (r == 0 || n >= program.instructions.size())
+          return fail(ET::STACK_UNDERFLOW, address);
+        std::vector<uint8_t> taken{stack.taken};
+        taken.resize(taken.size() + n + 1 - stack.values.size(), width);
+        stack.lift(taken);
+      }
+      for (uint64_t i = 0; i <= n; ++i)
+        if (stack.values[stack.values.size() - 1 - i] != width)
+          return fail(ET::WIDTH_MISMATCH, address);
+      return true;
+    }
+
+    // Follow the instruction at `address` in routine `r`
+    bool step(size_t r, uint64_t address)
+    {
+      current                        = address;
+      Stack stack                    = routines[r].stacks.at(address);
+      const Instruction &instruction = program.instructions[address];
+      const uint8_t op               = instruction.opcode;
+      if (op == OP_JUMP_STACK || op == OP_CALL_STACK)
+        return fail(ET::COMPUTED_JUMP, address);
+      else if (op == OP_HALT)
+        return true;
+      else if (op == OP_RET)
+        return ret(r, address, stack);
+      else if (op == OP_CALL)
+        return call(r, address, stack);
+      else if (op == OP_JUMP_ABS)
+        return reach(r, instruction.operand, stack);
+
+      std::vector<uint8_t> pops;
+      uint8_t push;
+      values(op, pops, push);
+      if (op >= OP_DUP_BYTE && op <= OP_DUP_WORD &&
+          !dup(stack, r, push, address))
+        return false;
+      for (const auto width : pops)
+        if (!pop(stack, r, width, address))
+          return false;
+      if (push)
+        stack.values.push_back(push);
+      if (op >= OP_JUMP_IF_BYTE && op <= OP_JUMP_IF_WORD &&
+          !reach(r, instruction.operand, stack))
+        return false;
+      return reach(r, address + 1, stack);
+    }
+  };
+
+  Err *verify(Program &program, Arena &arena)
+  {
+    Checker checker{program, arena, {}, {}, {}};
+    checker.routine(program.start);
+    while (!checker.work.empty())
+    {
+      const auto [r, address] = checker.work.back();
+      checker.work.pop_back();
+      if (!checker.step(r, address))
+        return checker.err;
+    }
+
+    program.depths.clear();
+    for (const auto &routine : checker.routines)
+      program.depths.push_back(
+          {routine.address, static_cast<uint64_t>(routine.depth)});
+    std::sort(program.depths.begin(), program.depths.end(),
+              [](const Parser::Depth &a, const Parser::Depth &b)
+              { return a.routine < b.routine; });
+    return nullptr;
+  }
+
+  std::string to_string(const Err::Type &type)
+  {
+    switch (type)
+    {
+    case ET::STACK_UNDERFLOW:
+      return "STACK_UNDERFLOW";
+    case ET::WIDTH_MISMATCH:
+      return "WIDTH_MISMATCH";
+    case ET::INCONSISTENT_STACK:
+      return "INCONSISTENT_STACK";
+    case ET::COMPUTED_JUMP:
+      return "COMPUTED_JUMP";
+    }
+    return "";
+  }
+
+  std::string to_string(const Err &err)
+  {
+    std::stringstream ss;
+    const auto pos = err.token->position();
+    ss << pos.source_name << ":" << pos.line << ":" << pos.column << ": "
+       << to_string(err.type);
+    return ss.str();
+  }
+
+  std::ostream &operator<<(std::ostream &stream, const Err &err)
+  {
+    return stream << to_string(err);
+  }
+
+  Err::Err()
+  {
+  }
+
+  Err::Err(Err::Type type, uint64_t address, Lexer::Token *token)
+      : address{address}, token{token}, type{type}
+  {
+  }
+} // namespace Verifier
@@ -0,0 +1,68 @@
+/* Copyright (C) 2024 Aryadev Chavali
+
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License Version 2 for
+ * details.
+
+ * You may distribute and modify this code under the terms of the GNU General
+ * Public License Version 2, which you should have received a copy of along with
+ * this program.  If not, please go to <https://www.gnu.org/licenses/>.
+
+ * Created: 2026-10-17
+ * Author: Aryadev Chavali
+ * Description: Static checks of the data stack of parsed programs
+ */
+
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include <src/arena.hpp>
+#include <src/parser.hpp>
+
+namespace Verifier
+{
+  struct Err
+  {
+    // Instruction at fault, and the token it was parsed from
+    uint64_t address;
+    Lexer::Token *token;
+    enum class Type
+    {
+      // Popping more than the program has pushed
+      STACK_UNDERFLOW,
+      // Popping a value as a type of another width than it was pushed as
+      WIDTH_MISMATCH,
+      // Reaching an instruction, or returning, with differing stacks
+      INCONSISTENT_STACK,
+      // Jumping to or calling an address on the stack, which can't be
+      // followed
+      COMPUTED_JUMP,
+    } type;
+
+    Err();
+    Err(Err::Type, uint64_t, Lexer::Token *);
+  };
+
+  // Check that every instruction reachable from the start of `program` is
+  // always reached with the same stack, as the widths of the values on it, and
+  // that each instruction pops values of the widths it's for.  Each routine,
+  // the start and any address called, is checked alone: a call pops and
+  // pushes what the routine does between its entry and any ret, which must
+  // agree, so a routine may take values its callers pushed.
+  //
+  // On success, program.depths holds the most bytes each routine has on the
+  // stack above its entry, leaving out what its calls have while they run.
+  // Errors are owned by `arena`.
+  Err *verify(Parser::Program &program, Arena &arena);
+
+  std::string to_string(const Err::Type &);
+  std::string to_string(const Err &);
+  std::ostream &operator<<(std::ostream &, const Err &);
+} // namespace Verifier
+
+#endif